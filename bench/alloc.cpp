@@ -0,0 +1,43 @@
+// Host allocation latency and page faults for alloc, touch and release cycles.
+// Run once as is and once with ANYDSL_CPU_CACHE=<MiB> to measure the allocation cache.
+#include "anydsl_runtime.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+static long page_faults() { return 0; }
+#else
+#include <sys/resource.h>
+
+static long page_faults() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+#endif
+
+int main(int argc, char** argv) {
+    int32_t reps = argc > 1 ? std::atoi(argv[1]) : 200;
+    const char* cache = std::getenv("ANYDSL_CPU_CACHE");
+    std::printf("cache: %s\n", cache ? cache : "disabled");
+
+    for (int64_t size = 64 * 1024; size <= 64 * 1024 * 1024; size *= 4) {
+        // Warm up, so that a cached run starts with the block in the cache
+        anydsl_release(0, anydsl_alloc(0, size));
+
+        long faults = page_faults();
+        uint64_t t0 = anydsl_get_micro_time();
+        for (int32_t i = 0; i < reps; i++) {
+            void* ptr = anydsl_alloc(0, size);
+            std::memset(ptr, i, size);
+            anydsl_release(0, ptr);
+        }
+        uint64_t t = anydsl_get_micro_time() - t0;
+        std::printf("%10lld bytes: %9.1f us, %6ld page faults per alloc/touch/release\n",
+                    (long long)size, double(t) / reps, (page_faults() - faults) / reps);
+    }
+    anydsl_trim(0);
+    return 0;
+}
@@ -0,0 +1,46 @@
+// Host copy bandwidth of anydsl_copy against memcpy, from 64 KiB to 256 MiB.
+// Use it to tune ANYDSL_PARALLEL_COPY and ANYDSL_STREAMING_COPY: the thresholds should sit where anydsl_copy overtakes memcpy.
+#include "anydsl_runtime.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char** argv) {
+    int64_t max_size = int64_t(argc > 1 ? std::atoi(argv[1]) : 256) << 20;
+    char* src = static_cast<char*>(anydsl_alloc(0, max_size));
+    char* dst = static_cast<char*>(anydsl_alloc(0, max_size));
+    for (int64_t i = 0; i < max_size; i++)
+        src[i] = char(i * 7 + 3);
+    std::memset(dst, 0, max_size);
+
+    std::printf("%12s %16s %16s\n", "bytes", "anydsl_copy MB/s", "memcpy MB/s");
+    for (int64_t size = 64 * 1024; size <= max_size; size *= 4) {
+        // Copy about 1 GiB in total for every size
+        int32_t reps = int32_t(std::max(int64_t(1), (int64_t(1) << 30) / size));
+
+        anydsl_copy(0, src, 0, 0, dst, 0, size);
+        uint64_t t0 = anydsl_get_micro_time();
+        for (int32_t i = 0; i < reps; i++)
+            anydsl_copy(0, src, 0, 0, dst, 0, size);
+        uint64_t t_copy = std::max(anydsl_get_micro_time() - t0, uint64_t(1));
+        if (std::memcmp(src, dst, size) != 0) {
+            std::printf("anydsl_copy: wrong result for %lld bytes\n", (long long)size);
+            return 1;
+        }
+
+        std::memcpy(dst, src, size);
+        t0 = anydsl_get_micro_time();
+        for (int32_t i = 0; i < reps; i++)
+            std::memcpy(dst, src, size);
+        uint64_t t_memcpy = std::max(anydsl_get_micro_time() - t0, uint64_t(1));
+
+        std::printf("%12lld %16.1f %16.1f\n", (long long)size,
+                    double(size) * reps / t_copy, double(size) * reps / t_memcpy);
+    }
+
+    anydsl_release(0, src);
+    anydsl_release(0, dst);
+    return 0;
+}
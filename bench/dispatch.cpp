@@ -0,0 +1,63 @@
+// Dispatch overhead of parallel_for: many calls on a small range, against creating threads per call.
+#include "anydsl_runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+static std::atomic<int64_t> sum(0);
+
+static void body(void*, int32_t lower, int32_t upper) {
+    int64_t s = 0;
+    for (int32_t i = lower; i < upper; i++)
+        s += i;
+    sum.fetch_add(s, std::memory_order_relaxed);
+}
+
+// What parallel_for did before the thread pool: one thread per slice, created and joined on every call
+static void parallel_for_threads(int32_t num_threads, int32_t lower, int32_t upper) {
+    std::vector<std::thread> threads;
+    int32_t slice = (upper - lower) / num_threads;
+    for (int32_t i = 0; i < num_threads; i++) {
+        int32_t a = lower + i * slice;
+        int32_t b = i == num_threads - 1 ? upper : a + slice;
+        threads.emplace_back(body, nullptr, a, b);
+    }
+    for (auto& thread : threads)
+        thread.join();
+}
+
+int main(int argc, char** argv) {
+    int32_t calls = argc > 1 ? std::atoi(argv[1]) : 20000;
+    int32_t num_threads = argc > 2 ? std::atoi(argv[2]) : 4;
+    const int32_t range = 1024;
+    const int64_t expected = int64_t(range) * (range - 1) / 2;
+
+    sum = 0;
+    uint64_t t0 = anydsl_get_micro_time();
+    for (int32_t i = 0; i < calls; i++)
+        anydsl_parallel_for(num_threads, 0, range, nullptr, reinterpret_cast<void*>(body));
+    uint64_t t = anydsl_get_micro_time() - t0;
+    if (sum != expected * calls) {
+        std::printf("parallel_for: wrong result\n");
+        return 1;
+    }
+    std::printf("parallel_for, %d threads: %.2f us per call\n", num_threads, double(t) / calls);
+
+    // Thread creation is much slower, fewer calls are enough
+    int32_t thread_calls = std::max(calls / 10, 1);
+    sum = 0;
+    t0 = anydsl_get_micro_time();
+    for (int32_t i = 0; i < thread_calls; i++)
+        parallel_for_threads(num_threads, 0, range);
+    t = anydsl_get_micro_time() - t0;
+    if (sum != expected * thread_calls) {
+        std::printf("threads: wrong result\n");
+        return 1;
+    }
+    std::printf("threads per call, %d threads: %.2f us per call\n", num_threads, double(t) / thread_calls);
+    return 0;
+}
@@ -0,0 +1,87 @@
+// Task executor benchmark: recursive spawn/sync and a layered flow graph.
+// Build once with and once without TBB to compare the native executor with TBB.
+#include "anydsl_runtime.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#ifdef BENCH_WITH_TBB
+static const char* executor_name = "tbb";
+#else
+static const char* executor_name = "native";
+#endif
+
+// Below this depth, fib runs serially so that tasks are not too small
+static const int32_t fib_cutoff = 12;
+
+static int32_t fib_serial(int32_t n) {
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+static int32_t fib_task(void* data) {
+    int32_t n = *static_cast<int32_t*>(data);
+    if (n < fib_cutoff)
+        return fib_serial(n);
+    int32_t m = n - 1;
+    int32_t id = anydsl_spawn_thread(&m, reinterpret_cast<void*>(fib_task));
+    int32_t k = n - 2;
+    int32_t b = fib_task(&k);
+    return int32_t(anydsl_future_get(id)) + b;
+}
+
+// Layered graph: every node depends on two nodes of the previous layer
+static const int32_t graph_layers = 100;
+static const int32_t graph_width = 200;
+static std::vector<std::atomic<int32_t>> node_runs(graph_layers * graph_width);
+
+static void run_node(uint64_t payload) {
+    node_runs[payload].fetch_add(1, std::memory_order_relaxed);
+}
+
+static void run_root(uint64_t) {}
+
+int main(int argc, char** argv) {
+    int32_t n = argc > 1 ? std::atoi(argv[1]) : 30;
+    int32_t reps = argc > 2 ? std::atoi(argv[2]) : 10;
+    std::printf("executor: %s\n", executor_name);
+
+    int32_t expected = fib_serial(n);
+    uint64_t t0 = anydsl_get_micro_time();
+    for (int32_t i = 0; i < reps; i++) {
+        if (fib_task(&n) != expected) {
+            std::printf("fib(%d): wrong result\n", n);
+            return 1;
+        }
+    }
+    std::printf("fib(%d) spawn/sync: %.1f us per run\n", n, double(anydsl_get_micro_time() - t0) / reps);
+
+    int32_t graph = anydsl_create_graph();
+    int32_t root = anydsl_create_task(graph, Closure{ run_root, 0 });
+    std::vector<int32_t> nodes(graph_layers * graph_width);
+    for (size_t i = 0; i < nodes.size(); i++)
+        nodes[i] = anydsl_create_task(graph, Closure{ run_node, uint64_t(i) });
+    for (int32_t j = 0; j < graph_width; j++)
+        anydsl_create_edge(root, nodes[j]);
+    for (int32_t l = 1; l < graph_layers; l++) {
+        for (int32_t j = 0; j < graph_width; j++) {
+            anydsl_create_edge(nodes[(l - 1) * graph_width + j], nodes[l * graph_width + j]);
+            anydsl_create_edge(nodes[(l - 1) * graph_width + (j + 1) % graph_width], nodes[l * graph_width + j]);
+        }
+    }
+
+    t0 = anydsl_get_micro_time();
+    for (int32_t i = 0; i < reps; i++)
+        anydsl_execute_graph(graph, root);
+    uint64_t t = anydsl_get_micro_time() - t0;
+    for (auto& runs : node_runs) {
+        if (runs.load() != reps) {
+            std::printf("graph: node ran %d times instead of %d\n", runs.load(), reps);
+            return 1;
+        }
+    }
+    std::printf("graph of %d nodes: %.1f us per run\n", graph_layers * graph_width, double(t) / reps);
+    anydsl_destroy_graph(graph);
+    return 0;
+}
@@ -0,0 +1,258 @@
+#ifndef ANYDSL_CORO_HPP
+#define ANYDSL_CORO_HPP
+
+#if !defined(__cpp_impl_coroutine)
+#error "anydsl_coro.hpp requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#ifndef ANYDSL_RUNTIME_HPP
+#include "anydsl_runtime.hpp"
+#endif
+
+/// Coroutine front end for the task system of the runtime. Suspended coroutines do not hold a thread:
+/// they are resumed on the thread pool of the runtime once the awaited work has completed.
+namespace anydsl {
+
+namespace detail {
+
+template <typename T>
+struct TaskResult {
+    std::optional<T> value;
+
+    template <typename U>
+    void return_value(U&& u) { value.emplace(std::forward<U>(u)); }
+    T take() { return std::move(*value); }
+};
+
+template <>
+struct TaskResult<void> {
+    void return_void() {}
+    void take() {}
+};
+
+inline int32_t resume_handle(void* address) {
+    std::coroutine_handle<>::from_address(address).resume();
+    return 0;
+}
+
+} // namespace detail
+
+/// Lazily started coroutine: it runs when awaited, and resumes its awaiter once it has completed.
+template <typename T = void>
+class Task {
+public:
+    struct promise_type : detail::TaskResult<T> {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    auto continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return FinalAwaiter {};
+        }
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    Task(Task&& other)
+        : handle_(std::exchange(other.handle_, nullptr))
+    {}
+
+    Task& operator = (Task&& other) {
+        if (handle_) handle_.destroy();
+        handle_ = std::exchange(other.handle_, nullptr);
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator = (const Task&) = delete;
+
+    ~Task() { if (handle_) handle_.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+    T await_resume() {
+        auto& promise = handle_.promise();
+        if (promise.exception)
+            std::rethrow_exception(promise.exception);
+        return promise.take();
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle)
+    {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/// Moves the awaiting coroutine to a thread of the pool.
+inline auto schedule() {
+    struct ScheduleAwaiter {
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            anydsl_future_detach(anydsl_spawn_thread(handle.address(), reinterpret_cast<void*>(&detail::resume_handle)));
+        }
+        void await_resume() const noexcept {}
+    };
+    return ScheduleAwaiter {};
+}
+
+/// Waits for a future of the runtime (spawned task or promise) and returns its value.
+/// The future is consumed.
+inline auto await_future(int32_t id) {
+    struct FutureAwaiter {
+        int32_t id;
+        int64_t value;
+        std::coroutine_handle<> handle;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            // The coroutine may be resumed before anydsl_future_then returns, only locals are used afterwards
+            anydsl_future_detach(anydsl_future_then(id, this, reinterpret_cast<void*>(&resume)));
+        }
+        int64_t await_resume() const noexcept { return value; }
+
+        static int64_t resume(void* data, int64_t value) {
+            auto self = static_cast<FutureAwaiter*>(data);
+            self->value = value;
+            self->handle.resume();
+            return 0;
+        }
+    };
+    return FutureAwaiter { id, 0, nullptr };
+}
+
+/// Runs fun() on a thread of the pool and returns its result.
+/// Blocking runtime calls made by fun hold that thread, but not the awaiting coroutine.
+template <typename F>
+auto run(F fun) {
+    typedef std::invoke_result_t<F> R;
+    struct RunAwaiter {
+        F fun;
+        std::conditional_t<std::is_void<R>::value, bool, std::optional<R>> result;
+        std::exception_ptr exception;
+        std::coroutine_handle<> handle;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            anydsl_future_detach(anydsl_spawn_thread(this, reinterpret_cast<void*>(&execute)));
+        }
+        R await_resume() {
+            if (exception)
+                std::rethrow_exception(exception);
+            if constexpr (!std::is_void<R>::value)
+                return std::move(*result);
+        }
+
+        static int32_t execute(void* data) {
+            auto self = static_cast<RunAwaiter*>(data);
+            try {
+                if constexpr (std::is_void<R>::value)
+                    self->fun();
+                else
+                    self->result.emplace(self->fun());
+            } catch (...) {
+                self->exception = std::current_exception();
+            }
+            self->handle.resume();
+            return 0;
+        }
+    };
+    return RunAwaiter { std::move(fun), {}, nullptr, nullptr };
+}
+
+/// Waits for the device to complete its pending work.
+inline auto synchronize(int32_t dev) {
+    return run([dev] { anydsl_synchronize(dev); });
+}
+
+/// Copies the contents of a into b.
+template <typename T>
+auto copy_async(const Array<T>& a, Array<T>& b) {
+    return run([&a, &b] { copy(a, b); });
+}
+
+/// Copies size elements of a, starting at offset_a, into b at offset_b.
+template <typename T>
+auto copy_async(const Array<T>& a, int64_t offset_a, Array<T>& b, int64_t offset_b, int64_t size) {
+    return run([&a, offset_a, &b, offset_b, size] { copy(a, offset_a, b, offset_b, size); });
+}
+
+/// Copies the elements of the view a into b.
+template <typename S, typename T>
+auto copy_async(ArrayView<S> a, ArrayView<T> b) {
+    return run([a, b] { copy(a, b); });
+}
+
+namespace detail {
+
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template <typename T>
+Detached drive(Task<T> task, int32_t done, TaskResult<T>* result, std::exception_ptr* exception) {
+    try {
+        if constexpr (std::is_void<T>::value)
+            co_await task;
+        else
+            result->return_value(co_await task);
+    } catch (...) {
+        *exception = std::current_exception();
+    }
+    anydsl_promise_set(done, 0);
+}
+
+inline Detached drive_detached(Task<void> task) {
+    co_await schedule();
+    co_await task;
+}
+
+} // namespace detail
+
+/// Starts the task on the pool without waiting for it. Exceptions escaping the task terminate the program.
+inline void start(Task<void> task) {
+    detail::drive_detached(std::move(task));
+}
+
+/// Runs the task and waits for its result. The calling thread runs tasks of the pool meanwhile.
+template <typename T>
+T sync_wait(Task<T> task) {
+    int32_t done = anydsl_promise_create();
+    detail::TaskResult<T> result;
+    std::exception_ptr exception;
+    detail::drive(std::move(task), done, &result, &exception);
+    anydsl_future_get(done);
+    if (exception)
+        std::rethrow_exception(exception);
+    return result.take();
+}
+
+} // namespace anydsl
+
+#endif
@@ -17,16 +17,69 @@ enum {
     ANYDSL_HSA = 3
 };
 
+enum {
+    ANYDSL_ALLOC_DEFAULT = 0,
+    ANYDSL_ALLOC_HUGE_PAGES = 1,
+    ANYDSL_ALLOC_HUGETLB = 2,
+    ANYDSL_ALLOC_NO_HUGE_PAGES = 4
+};
+
 void anydsl_info(void);
 
+enum {
+    ANYDSL_MAP_READ_ONLY = 0,
+    ANYDSL_MAP_COPY_ON_WRITE = 1,
+    ANYDSL_MAP_SEQUENTIAL = 2,
+    ANYDSL_MAP_RANDOM = 4,
+    ANYDSL_MAP_WILLNEED = 8
+};
+
 void* anydsl_alloc(int32_t, int64_t);
+void* anydsl_alloc_flags(int32_t, int64_t, int32_t);
 void* anydsl_alloc_host(int32_t, int64_t);
 void* anydsl_alloc_unified(int32_t, int64_t);
 void* anydsl_get_device_ptr(int32_t, void*);
 void  anydsl_release(int32_t, void*);
 void  anydsl_release_host(int32_t, void*);
+void  anydsl_trim(int32_t);
+void* anydsl_map_file(const char*, int32_t, int64_t*);
+
+int32_t anydsl_create_arena(int64_t);
+void    anydsl_destroy_arena(int32_t);
+void*   anydsl_arena_alloc(int32_t, int64_t);
+void    anydsl_arena_reset(int32_t);
+
+// histogram[i] counts the allocations of [2^i, 2^(i+1)) bytes, the last bin also counts larger ones
+#define ANYDSL_MEMORY_HISTOGRAM_SIZE 40
+
+struct MemoryStats {
+    int64_t live_bytes;
+    int64_t peak_bytes;
+    int64_t live_allocs;
+    int64_t num_allocs;
+    int64_t num_releases;
+    int64_t histogram[ANYDSL_MEMORY_HISTOGRAM_SIZE];
+};
+
+void anydsl_memory_stats(int32_t, MemoryStats*);
+void anydsl_platform_memory_stats(int32_t, MemoryStats*);
 
 void anydsl_copy(int32_t, const void*, int64_t, int32_t, void*, int64_t, int64_t);
+void anydsl_memset(int32_t, void*, int64_t, int32_t, int64_t);
+void anydsl_fill(int32_t, void*, int64_t, uint32_t, int64_t);
+
+// Times are in microseconds, and count the time each stage of the stream spent working.
+// Copies to the device run in the processing stage: process_time includes copy_time.
+struct StreamStats {
+    int64_t bytes;
+    int64_t read_time;
+    int64_t copy_time;
+    int64_t process_time;
+    int64_t total_time;
+};
+
+void anydsl_stream_file(int32_t, const char*, int64_t, int32_t, void*, void*, StreamStats*);
+void anydsl_stream_host(int32_t, const void*, int64_t, int64_t, int32_t, void*, void*, StreamStats*);
 
 void anydsl_launch_kernel(int32_t,
                           const char*, const char*,
@@ -60,19 +113,49 @@ void anydsl_print_string(char*);
 void* anydsl_aligned_malloc(size_t, size_t);
 void anydsl_aligned_free(void*);
 
+enum {
+    ANYDSL_SCHEDULE_STATIC = 0,
+    ANYDSL_SCHEDULE_DYNAMIC = 1,
+    ANYDSL_SCHEDULE_GUIDED = 2
+};
+
 void anydsl_parallel_for(int32_t, int32_t, int32_t, void*, void*);
+void* anydsl_worker_scratch(int64_t);
+void anydsl_parallel_for_schedule(int32_t, int32_t, int32_t, int32_t, int32_t, void*, void*);
+void anydsl_parallel_for_cancellable(int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, void*, void*);
+void anydsl_parallel_for_2d(int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, void*, void*);
+void anydsl_parallel_for_3d(int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, int32_t, void*, void*);
+void anydsl_parallel_reduce(int32_t, int32_t, int32_t, void*, int32_t, void*, void*, void*);
 int32_t anydsl_spawn_thread(void*, void*);
+int32_t anydsl_spawn_thread_cancellable(void*, void*, int32_t);
 void anydsl_sync_thread(int32_t);
 
+int32_t anydsl_promise_create();
+void    anydsl_promise_set(int32_t, int64_t);
+int32_t anydsl_future_then(int32_t, void*, void*);
+void    anydsl_future_detach(int32_t);
+int64_t anydsl_future_get(int32_t);
+void    anydsl_future_wait_all(const int32_t*, int32_t);
+int32_t anydsl_future_wait_any(const int32_t*, int32_t);
+
 struct Closure {
     void (*fn)(uint64_t);
     uint64_t payload;
 };
 
 int32_t anydsl_create_graph();
+void    anydsl_destroy_graph(int32_t);
 int32_t anydsl_create_task(int32_t, Closure);
 void    anydsl_create_edge(int32_t, int32_t);
 void    anydsl_execute_graph(int32_t, int32_t);
+void    anydsl_execute_graph_cancellable(int32_t, int32_t, int32_t);
+
+int32_t anydsl_create_token();
+void    anydsl_destroy_token(int32_t);
+void    anydsl_cancel(int32_t);
+void    anydsl_set_deadline(int32_t, int64_t);
+int32_t anydsl_is_cancelled(int32_t);
+int64_t anydsl_skipped_work(int32_t);
 
 #ifdef RUNTIME_ENABLE_JIT
 void  anydsl_link(const char*);
@@ -5,6 +5,12 @@
 #include "anydsl_runtime.h"
 #endif
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
 namespace anydsl {
 
 enum class Platform : int32_t {
@@ -23,6 +29,9 @@ inline int32_t make_device(Platform p, Device d) {
     return ANYDSL_DEVICE((int32_t)p, d.id);
 }
 
+template <typename T>
+class ArrayView;
+
 template <typename T>
 class Array {
 public:
@@ -79,6 +88,20 @@ public:
     const T& operator [] (int i) const { return data_[i]; }
     T& operator [] (int i) { return data_[i]; }
 
+    ArrayView<T> view() { return ArrayView<T>(*this); }
+    ArrayView<const T> view() const { return ArrayView<const T>(*this); }
+
+    /// Returns a view of the elements in [begin, end).
+    ArrayView<T> slice(int64_t begin, int64_t end) { return view().slice(begin, end); }
+    ArrayView<const T> slice(int64_t begin, int64_t end) const { return view().slice(begin, end); }
+
+    /// Maps a file in host memory with ANYDSL_MAP_* flags. Trailing bytes that do not form a whole element are not part of the array.
+    static Array map_file(const char* path, int32_t flags = ANYDSL_MAP_READ_ONLY) {
+        int64_t size = 0;
+        T* ptr = (T*)anydsl_map_file(path, flags, &size);
+        return Array(ANYDSL_HOST, ptr, size / sizeof(T));
+    }
+
     T* release() {
         T* ptr = data_;
         data_ = nullptr;
@@ -102,6 +125,99 @@ protected:
     int32_t dev_;
 };
 
+/// Non-owning view of elements of an array, possibly strided. The offset is kept apart from the base pointer,
+/// since device pointers do not always support arithmetic (OpenCL buffers).
+/// The elements can only be accessed directly when the view is in host memory.
+template <typename T>
+class ArrayView {
+public:
+    ArrayView()
+        : dev_(0), base_(nullptr), offset_(0), size_(0), stride_(1)
+    {}
+
+    ArrayView(int32_t dev, T* base, int64_t offset, int64_t size, int64_t stride = 1)
+        : dev_(dev), base_(base), offset_(offset), size_(size), stride_(stride)
+    {}
+
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    ArrayView(Array<U>& a)
+        : ArrayView(a.device(), a.data(), 0, a.size())
+    {}
+
+    template <typename U, typename = typename std::enable_if<std::is_convertible<const U*, T*>::value>::type>
+    ArrayView(const Array<U>& a)
+        : ArrayView(a.device(), a.data(), 0, a.size())
+    {}
+
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    ArrayView(const ArrayView<U>& v)
+        : ArrayView(v.device(), v.base(), v.offset(), v.size(), v.stride())
+    {}
+
+    int32_t device() const { return dev_; }
+    /// Returns the start of the viewed array, without the offset of the view.
+    T* base() const { return base_; }
+    /// Returns the offset of the first element from the base, in elements.
+    int64_t offset() const { return offset_; }
+    int64_t size() const { return size_; }
+    /// Returns the distance between two consecutive elements, in elements.
+    int64_t stride() const { return stride_; }
+    bool contiguous() const { return stride_ == 1 || size_ <= 1; }
+
+    T* data() const { return base_ + offset_; }
+    T& operator [] (int64_t i) const { return base_[offset_ + i * stride_]; }
+
+    /// Returns a view of the elements in [begin, end).
+    ArrayView slice(int64_t begin, int64_t end) const {
+        assert(0 <= begin && begin <= end && end <= size_ && "Invalid slice");
+        return ArrayView(dev_, base_, offset_ + begin * stride_, end - begin, stride_);
+    }
+
+    /// Returns a view of size elements, taking one element every stride elements, starting at offset.
+    ArrayView subview(int64_t offset, int64_t size, int64_t stride = 1) const {
+        assert(offset >= 0 && stride > 0 && (size <= 0 || offset + (size - 1) * stride < size_) && "Invalid subview");
+        return ArrayView(dev_, base_, offset_ + offset * stride_, size, stride_ * stride);
+    }
+
+private:
+    int32_t dev_;
+    T* base_;
+    int64_t offset_;
+    int64_t size_;
+    int64_t stride_;
+};
+
+/// Copies the elements of a into b. Strided views of device memory are copied one element at a time.
+template <typename S, typename T>
+void copy(ArrayView<S> a, ArrayView<T> b) {
+    static_assert(std::is_same<typename std::remove_const<S>::type, T>::value, "Views must have the same element type");
+    assert(b.size() >= a.size() && "Destination is too small");
+    if (a.contiguous() && b.contiguous()) {
+        anydsl_copy(a.device(), (const void*)a.base(), a.offset() * sizeof(T),
+                    b.device(), (void*)b.base(), b.offset() * sizeof(T),
+                    a.size() * sizeof(T));
+    } else if ((a.device() & 0x0F) == ANYDSL_HOST && (b.device() & 0x0F) == ANYDSL_HOST) {
+        for (int64_t i = 0; i < a.size(); i++)
+            b[i] = a[i];
+    } else {
+        for (int64_t i = 0; i < a.size(); i++) {
+            anydsl_copy(a.device(), (const void*)a.base(), (a.offset() + i * a.stride()) * sizeof(T),
+                        b.device(), (void*)b.base(), (b.offset() + i * b.stride()) * sizeof(T),
+                        sizeof(T));
+        }
+    }
+}
+
+template <typename T>
+void copy(const Array<T>& a, ArrayView<T> b) {
+    copy(a.view(), b);
+}
+
+template <typename S, typename T>
+void copy(ArrayView<S> a, Array<T>& b) {
+    copy(a, b.view());
+}
+
 template <typename T>
 void copy(const Array<T>& a, Array<T>& b) {
     anydsl_copy(a.device(), (const void*)a.data(), 0,
@@ -123,6 +239,103 @@ void copy(const Array<T>& a, int64_t offset_a, Array<T>& b, int64_t offset_b, in
                 size * sizeof(T));
 }
 
+/// Array with a copy on the host and a copy on a device, kept in sync lazily. The array is split in chunks,
+/// each valid on the host, on the device or on both. Accessing a range on one side first copies the chunks
+/// of the range that are only valid on the other side. Writing a range invalidates it on the other side.
+template <typename T>
+class MirroredArray {
+public:
+    /// Chunks are a page by default.
+    MirroredArray(Platform p, Device d, int64_t size, int64_t chunk_size = 0)
+        : host_(Platform::Host, Device(0), size),
+          device_(p, d, size),
+          chunk_size_(chunk_size > 0 ? chunk_size : (sizeof(T) < 4096 ? 4096 / sizeof(T) : 1)),
+          valid_((size + chunk_size_ - 1) / chunk_size_, Valid::Both),
+          copied_bytes_(0)
+    {}
+
+    int64_t size() const { return host_.size(); }
+    int64_t chunk_size() const { return chunk_size_; }
+    /// Returns the number of bytes copied between the host and the device so far.
+    int64_t copied_bytes() const { return copied_bytes_; }
+
+    ArrayView<const T> host_read() { return host_read(0, size()); }
+    ArrayView<T> host_write() { return host_write(0, size()); }
+    ArrayView<T> host_overwrite() { return host_overwrite(0, size()); }
+    ArrayView<const T> device_read() { return device_read(0, size()); }
+    ArrayView<T> device_write() { return device_write(0, size()); }
+    ArrayView<T> device_overwrite() { return device_overwrite(0, size()); }
+
+    /// Returns the elements in [begin, end) on the host, for reading.
+    ArrayView<const T> host_read(int64_t begin, int64_t end) { return access(Valid::Host, begin, end, true, false); }
+    /// Returns the elements in [begin, end) on the host, for reading and writing.
+    ArrayView<T> host_write(int64_t begin, int64_t end) { return access(Valid::Host, begin, end, true, true); }
+    /// Returns the elements in [begin, end) on the host, to be entirely overwritten: only partially covered chunks are synchronized.
+    ArrayView<T> host_overwrite(int64_t begin, int64_t end) { return access(Valid::Host, begin, end, false, true); }
+    ArrayView<const T> device_read(int64_t begin, int64_t end) { return access(Valid::Device, begin, end, true, false); }
+    ArrayView<T> device_write(int64_t begin, int64_t end) { return access(Valid::Device, begin, end, true, true); }
+    ArrayView<T> device_overwrite(int64_t begin, int64_t end) { return access(Valid::Device, begin, end, false, true); }
+
+private:
+    enum class Valid : uint8_t { Both, Host, Device };
+
+    ArrayView<T> access(Valid side, int64_t begin, int64_t end, bool read, bool write) {
+        assert(0 <= begin && begin <= end && end <= size() && "Invalid range");
+        if (begin == end)
+            return array(side).slice(begin, end);
+
+        int64_t first = begin / chunk_size_;
+        int64_t last = (end - 1) / chunk_size_;
+        Valid other = side == Valid::Host ? Valid::Device : Valid::Host;
+
+        // Copies runs of consecutive chunks valid only on the other side at once
+        int64_t run = -1;
+        for (int64_t chunk = first; chunk <= last + 1; chunk++) {
+            bool stale = false;
+            if (chunk <= last && valid_[chunk] == other) {
+                // Chunks entirely overwritten need not be synchronized
+                bool covered = chunk * chunk_size_ >= begin && std::min((chunk + 1) * chunk_size_, size()) <= end;
+                stale = read || !covered;
+                if (!stale)
+                    valid_[chunk] = Valid::Both;
+            }
+            if (stale && run < 0)
+                run = chunk;
+            if (!stale && run >= 0) {
+                sync(side, run, chunk);
+                run = -1;
+            }
+        }
+
+        if (write) {
+            for (int64_t chunk = first; chunk <= last; chunk++)
+                valid_[chunk] = side;
+        }
+        return array(side).slice(begin, end);
+    }
+
+    // Copies the chunks in [first, last) to the given side
+    void sync(Valid side, int64_t first, int64_t last) {
+        int64_t begin = first * chunk_size_;
+        int64_t count = std::min(last * chunk_size_, size()) - begin;
+        if (side == Valid::Host)
+            copy(device_.slice(begin, begin + count), host_.slice(begin, begin + count));
+        else
+            copy(host_.slice(begin, begin + count), device_.slice(begin, begin + count));
+        copied_bytes_ += count * sizeof(T);
+        for (int64_t chunk = first; chunk < last; chunk++)
+            valid_[chunk] = Valid::Both;
+    }
+
+    Array<T>& array(Valid side) { return side == Valid::Host ? host_ : device_; }
+
+    Array<T> host_;
+    Array<T> device_;
+    int64_t chunk_size_;
+    std::vector<Valid> valid_;
+    int64_t copied_bytes_;
+};
+
 } // namespace anydsl
 
 #endif
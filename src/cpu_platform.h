@@ -1,10 +1,27 @@
 #ifndef CPU_PLATFORM_H
 #define CPU_PLATFORM_H
 
+#include "host_cache.h"
 #include "platform.h"
 #include "runtime.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /// CPU platform, allocation is guaranteed to be aligned to page size: 4096 bytes.
 class CpuPlatform : public Platform {
@@ -14,8 +31,159 @@ public:
     {}
 
 protected:
-    void* alloc(DeviceId, int64_t size) override {
-        return anydsl_aligned_malloc(size, 4096);
+    static const int64_t huge_page_size = 2 * 1024 * 1024;
+    /// Allocations of at least this size use the huge page policy of the runtime by default.
+    static const int64_t huge_page_threshold = 8 * 1024 * 1024;
+
+    void* alloc(DeviceId dev, int64_t size) override {
+        return alloc_flags(dev, size, ANYDSL_ALLOC_DEFAULT);
+    }
+
+    void* alloc_flags(DeviceId, int64_t size, int32_t flags) override {
+        HugePages huge_pages = HugePages::Never;
+        if (flags & ANYDSL_ALLOC_HUGETLB)
+            huge_pages = HugePages::HugeTLB;
+        else if (flags & ANYDSL_ALLOC_HUGE_PAGES)
+            huge_pages = HugePages::Madvise;
+        else if (!(flags & ANYDSL_ALLOC_NO_HUGE_PAGES) && size >= huge_page_threshold)
+            huge_pages = runtime_->huge_pages();
+
+        void* ptr = nullptr;
+        if (huge_pages == HugePages::HugeTLB) {
+            ptr = map_huge_pages(size);
+            if (ptr) {
+                if (runtime_->first_touch_enabled())
+                    first_touch(ptr, size);
+                return ptr;
+            }
+            // The pool of huge pages is exhausted or not configured: use transparent huge pages instead
+            huge_pages = HugePages::Madvise;
+        }
+
+        // Huge pages are advised for whole pages, so the block must span them
+        int64_t alloc_size = huge_pages == HugePages::Madvise ? round_to_huge_pages(size) : size;
+
+        // Memory reused from the cache has already been touched
+        bool fresh = true;
+        auto& cache = HostCache::instance();
+        if (cache.enabled())
+            ptr = cache.alloc(alloc_size, fresh);
+        else if (huge_pages == HugePages::Madvise)
+            ptr = anydsl_aligned_malloc(alloc_size, huge_page_size);
+        else
+            ptr = anydsl_aligned_malloc(size, 4096);
+
+#ifdef __linux__
+        if (ptr && fresh && huge_pages == HugePages::Madvise)
+            madvise(ptr, alloc_size, MADV_HUGEPAGE);
+#endif
+        if (ptr && fresh && runtime_->first_touch_enabled())
+            first_touch(ptr, size);
+        return ptr;
+    }
+
+    static int64_t round_to_huge_pages(int64_t size) {
+        return (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+    }
+
+    /// Maps explicit huge pages from the pool of the system, returns nullptr if none are available.
+    void* map_huge_pages(int64_t size) {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+        size = round_to_huge_pages(size);
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr == MAP_FAILED)
+            return nullptr;
+        add_mapping(ptr, size);
+        return ptr;
+#else
+        unused(size);
+        return nullptr;
+#endif
+    }
+
+    void* map_file(DeviceId dev, const char* path, int32_t flags, int64_t& size) override {
+#ifdef __linux__
+        unused(dev);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            error("Cannot open file '%'", path);
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+            error("Cannot get the size of file '%'", path);
+        size = info.st_size;
+        if (size == 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        // Copy-on-write pages are private to the process, writes never reach the file
+        bool cow = flags & ANYDSL_MAP_COPY_ON_WRITE;
+        void* ptr = mmap(nullptr, size, cow ? PROT_READ | PROT_WRITE : PROT_READ, cow ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+            error("Cannot map file '%'", path);
+
+        if (flags & ANYDSL_MAP_SEQUENTIAL)
+            madvise(ptr, size, MADV_SEQUENTIAL);
+        if (flags & ANYDSL_MAP_RANDOM)
+            madvise(ptr, size, MADV_RANDOM);
+        if (flags & ANYDSL_MAP_WILLNEED)
+            madvise(ptr, size, MADV_WILLNEED);
+        add_mapping(ptr, size);
+        return ptr;
+#else
+        // Without mmap, the file is read into a regular allocation
+        unused(flags);
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            error("Cannot open file '%'", path);
+        fseek(file, 0, SEEK_END);
+        size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        void* ptr = size > 0 ? alloc(dev, size) : nullptr;
+        if (size > 0 && fread(ptr, size, 1, file) != 1)
+            error("Cannot read file '%'", path);
+        fclose(file);
+        return ptr;
+#endif
+    }
+
+    void add_mapping(void* ptr, int64_t size) {
+        std::lock_guard<std::mutex> lock(mapped_mutex_);
+        mapped_[ptr] = size;
+        num_mapped_++;
+    }
+
+    /// Unmaps memory obtained from map_huge_pages or map_file, returns false if the memory was not mapped there.
+    bool unmap(void* ptr) {
+#ifdef __linux__
+        if (num_mapped_.load(std::memory_order_relaxed) == 0)
+            return false;
+        std::lock_guard<std::mutex> lock(mapped_mutex_);
+        auto it = mapped_.find(ptr);
+        if (it == mapped_.end())
+            return false;
+        munmap(ptr, it->second);
+        mapped_.erase(it);
+        num_mapped_--;
+        return true;
+#else
+        unused(ptr);
+        return false;
+#endif
+    }
+
+    /// Touches the pages with the default static partitioning of parallel_for, so that each page
+    /// is placed on the NUMA node of the worker that processes the matching part of the buffer.
+    static void first_touch(void* ptr, int64_t size) {
+        struct Pages { char* data; int64_t size; } pages = { (char*)ptr, size };
+        auto touch = [] (void* args, int32_t a, int32_t b) {
+            auto pages = (Pages*)args;
+            for (int64_t i = a; i < b; i++)
+                pages->data[i * 4096] = 0;
+        };
+        void (*touch_ptr) (void*, int32_t, int32_t) = touch;
+        anydsl_parallel_for_schedule(0, 0, int32_t((size + 4095) / 4096), ANYDSL_SCHEDULE_STATIC, 0, &pages, (void*)touch_ptr);
     }
 
     void* alloc_host(DeviceId dev, int64_t size) override {
@@ -31,13 +199,23 @@ protected:
     }
 
     void release(DeviceId, void* ptr) override {
-        anydsl_aligned_free(ptr);
+        if (unmap(ptr))
+            return;
+        auto& cache = HostCache::instance();
+        if (cache.enabled())
+            cache.release(ptr);
+        else
+            anydsl_aligned_free(ptr);
     }
 
     void release_host(DeviceId dev, void* ptr) override {
         release(dev, ptr);
     }
 
+    void trim(DeviceId) override {
+        HostCache::instance().trim();
+    }
+
     void no_kernel() { error("Kernels are not supported on the CPU"); }
 
     void launch_kernel(DeviceId,
@@ -47,8 +225,119 @@ protected:
                        uint32_t) override { no_kernel(); }
     void synchronize(DeviceId) override { no_kernel(); }
 
+    /// Large copies are split in pieces of this size, processed by the workers of the pool.
+    static const int64_t copy_piece_size = 1024 * 1024;
+
     void copy(const void* src, int64_t offset_src, void* dst, int64_t offset_dst, int64_t size) {
-        memcpy((char*)dst + offset_dst, (char*)src + offset_src, size);
+        if (size < runtime_->parallel_copy_threshold()) {
+            memcpy((char*)dst + offset_dst, (char*)src + offset_src, size);
+            return;
+        }
+
+        struct Copy { char* dst; const char* src; int64_t size; bool streaming; } copy = {
+            (char*)dst + offset_dst, (const char*)src + offset_src, size,
+            size >= runtime_->streaming_copy_threshold()
+        };
+        auto copy_pieces = [] (void* args, int32_t a, int32_t b) {
+            auto copy = (Copy*)args;
+            int64_t begin = a * copy_piece_size;
+            int64_t end = std::min(b * copy_piece_size, copy->size);
+            if (copy->streaming)
+                stream_copy(copy->dst + begin, copy->src + begin, end - begin);
+            else
+                memcpy(copy->dst + begin, copy->src + begin, end - begin);
+        };
+        void (*copy_ptr) (void*, int32_t, int32_t) = copy_pieces;
+        anydsl_parallel_for_schedule(0, 0, int32_t((size + copy_piece_size - 1) / copy_piece_size), ANYDSL_SCHEDULE_STATIC, 0, &copy, (void*)copy_ptr);
+    }
+
+    /// Copies memory with non-temporal stores, which bypass the caches: the destination is not read back
+    /// through the caches, and the source stays cached.
+    static void stream_copy(char* dst, const char* src, int64_t size) {
+#ifdef __SSE2__
+        int64_t head = std::min(size, int64_t((16 - reinterpret_cast<uintptr_t>(dst) % 16) % 16));
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        size -= head;
+
+        int64_t i = 0;
+        for (; i + 64 <= size; i += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+            _mm_stream_si128((__m128i*)(dst + i), a);
+            _mm_stream_si128((__m128i*)(dst + i + 16), b);
+            _mm_stream_si128((__m128i*)(dst + i + 32), c);
+            _mm_stream_si128((__m128i*)(dst + i + 48), d);
+        }
+        memcpy(dst + i, src + i, size - i);
+        // Non-temporal stores are weakly ordered: make them visible before the copy is reported as complete
+        _mm_sfence();
+#else
+        memcpy(dst, src, size);
+#endif
+    }
+
+    void fill(DeviceId, void* ptr, int64_t offset, int64_t size, uint32_t pattern, int32_t pattern_size) override {
+        if (pattern_size == 1)
+            pattern = (pattern & 0xFF) * 0x01010101u;
+        if (size < runtime_->parallel_copy_threshold()) {
+            fill_memory((char*)ptr + offset, size, pattern, false);
+            return;
+        }
+
+        // Pieces start at multiples of the pattern size, so that the pattern stays in phase
+        struct Fill { char* dst; int64_t size; uint32_t pattern; bool streaming; } fill = {
+            (char*)ptr + offset, size, pattern,
+            size >= runtime_->streaming_copy_threshold()
+        };
+        auto fill_pieces = [] (void* args, int32_t a, int32_t b) {
+            auto fill = (Fill*)args;
+            int64_t begin = a * copy_piece_size;
+            int64_t end = std::min(b * copy_piece_size, fill->size);
+            fill_memory(fill->dst + begin, end - begin, fill->pattern, fill->streaming);
+        };
+        void (*fill_ptr) (void*, int32_t, int32_t) = fill_pieces;
+        anydsl_parallel_for_schedule(0, 0, int32_t((size + copy_piece_size - 1) / copy_piece_size), ANYDSL_SCHEDULE_STATIC, 0, &fill, (void*)fill_ptr);
+    }
+
+    /// Repeats the 4 bytes of pattern (in memory order) from dst, optionally with non-temporal stores.
+    static void fill_memory(char* dst, int64_t size, uint32_t pattern, bool streaming) {
+        char bytes[4];
+        memcpy(bytes, &pattern, 4);
+        if (pattern == (pattern & 0xFF) * 0x01010101u && !streaming) {
+            memset(dst, bytes[0], size);
+            return;
+        }
+
+        int64_t i = 0;
+#ifdef __SSE2__
+        if (streaming) {
+            for (; i < size && reinterpret_cast<uintptr_t>(dst + i) % 16 != 0; i++)
+                dst[i] = bytes[i % 4];
+            // The vector starts in the middle of the pattern if the head is not a multiple of 4 bytes
+            uint32_t phase = uint32_t(i % 4) * 8;
+            uint32_t rotated = phase ? (pattern >> phase) | (pattern << (32 - phase)) : pattern;
+            __m128i value = _mm_set1_epi32(int(rotated));
+            for (; i + 64 <= size; i += 64) {
+                _mm_stream_si128((__m128i*)(dst + i), value);
+                _mm_stream_si128((__m128i*)(dst + i + 16), value);
+                _mm_stream_si128((__m128i*)(dst + i + 32), value);
+                _mm_stream_si128((__m128i*)(dst + i + 48), value);
+            }
+            for (; i < size; i++)
+                dst[i] = bytes[i % 4];
+            _mm_sfence();
+            return;
+        }
+#endif
+        // Doubles the filled prefix, which is a whole number of patterns, until the memory is filled
+        for (; i < std::min(size, int64_t(4)); i++)
+            dst[i] = bytes[i];
+        for (; i < size; i *= 2)
+            memcpy(dst + i, dst, std::min(i, size - i));
     }
 
     void copy(DeviceId, const void* src, int64_t offset_src,
@@ -66,6 +355,11 @@ protected:
 
     size_t dev_count() const override { return 1; }
     std::string name() const override { return "CPU"; }
+
+    // Regions mapped with explicit huge pages or from files, with their size
+    std::mutex mapped_mutex_;
+    std::unordered_map<void*, int64_t> mapped_;
+    std::atomic<int32_t> num_mapped_ { 0 };
 };
 
 #endif
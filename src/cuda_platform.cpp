@@ -256,6 +256,22 @@ void CudaPlatform::copy_from_host(const void* src, int64_t offset_src, DeviceId
     cuCtxPopCurrent(NULL);
 }
 
+void CudaPlatform::fill(DeviceId dev, void* ptr, int64_t offset, int64_t size, uint32_t pattern, int32_t pattern_size) {
+    cuCtxPushCurrent(devices_[dev].ctx);
+
+    CUdeviceptr mem = (CUdeviceptr)ptr + offset;
+
+    if (pattern_size == 1) {
+        CUresult err = cuMemsetD8(mem, (unsigned char)pattern, size);
+        CHECK_CUDA(err, "cuMemsetD8()");
+    } else {
+        CUresult err = cuMemsetD32(mem, pattern, size / 4);
+        CHECK_CUDA(err, "cuMemsetD32()");
+    }
+
+    cuCtxPopCurrent(NULL);
+}
+
 void CudaPlatform::copy_to_host(DeviceId dev_src, const void* src, int64_t offset_src, void* dst, int64_t offset_dst, int64_t size) {
     cuCtxPushCurrent(devices_[dev_src].ctx);
 
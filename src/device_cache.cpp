@@ -0,0 +1,148 @@
+#include "device_cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+#include "log.h"
+
+static const int64_t alignment = 256;
+// Small requests share chunks of this size, larger ones get chunks rounded to a multiple of it
+static const int64_t chunk_size = 2 * 1024 * 1024;
+static const int64_t small_size = 1024 * 1024;
+// Blocks are only split if the remainder is at least that large
+static const int64_t min_split_size = 512;
+
+DeviceCache::DeviceCache(AllocFn alloc, ReleaseFn release, bool splittable)
+    : alloc_(alloc), release_(release), splittable_(splittable)
+{}
+
+DeviceCache::~DeviceCache() {
+    // Memory still in use is released along with the cache
+    for (auto& chunk : chunks_)
+        release_(chunk.first);
+    for (auto& used : used_)
+        release_(used.first);
+    for (auto& cached : cached_)
+        release_(cached.second);
+}
+
+void* DeviceCache::alloc(int64_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return splittable_ ? alloc_split(size) : alloc_whole(size);
+}
+
+bool DeviceCache::release(void* ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (splittable_) {
+        auto it = blocks_.find(static_cast<char*>(ptr));
+        if (it == blocks_.end() || it->second.free)
+            return false;
+        release_split(it);
+    } else {
+        auto it = used_.find(ptr);
+        if (it == used_.end())
+            return false;
+        cached_.emplace(it->second, ptr);
+        used_.erase(it);
+    }
+    return true;
+}
+
+void DeviceCache::trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& cached : cached_)
+        release_(cached.second);
+    cached_.clear();
+
+    // Chunks made of a single free block are not used anymore
+    for (auto it = chunks_.begin(); it != chunks_.end(); ) {
+        auto block = blocks_.find(it->first);
+        if (block->second.free && block->second.size == it->second) {
+            remove_free(block->first, block->second.size);
+            blocks_.erase(block);
+            release_(it->first);
+            it = chunks_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void* DeviceCache::alloc_split(int64_t size) {
+    size = (std::max(size, int64_t(1)) + alignment - 1) / alignment * alignment;
+
+    // Best fit among the free blocks
+    auto fit = free_blocks_.lower_bound(size);
+    char* ptr;
+    if (fit != free_blocks_.end()) {
+        ptr = fit->second;
+        free_blocks_.erase(fit);
+    } else {
+        int64_t new_chunk_size = size <= small_size ? chunk_size : (size + chunk_size - 1) / chunk_size * chunk_size;
+        ptr = static_cast<char*>(alloc_(new_chunk_size));
+        if (!ptr)
+            return nullptr;
+        chunks_[ptr] = new_chunk_size;
+        blocks_[ptr] = Block { new_chunk_size, ptr, true };
+    }
+
+    auto& block = blocks_[ptr];
+    if (block.size - size >= min_split_size) {
+        char* rest = ptr + size;
+        blocks_[rest] = Block { block.size - size, block.chunk, true };
+        free_blocks_.emplace(block.size - size, rest);
+        block.size = size;
+    }
+    block.free = false;
+    return ptr;
+}
+
+void* DeviceCache::alloc_whole(int64_t size) {
+    // Reuse a cached allocation unless it wastes more than half of its size
+    auto fit = cached_.lower_bound(size);
+    if (fit != cached_.end() && fit->first <= 2 * size) {
+        void* ptr = fit->second;
+        used_[ptr] = fit->first;
+        cached_.erase(fit);
+        return ptr;
+    }
+
+    void* ptr = alloc_(size);
+    if (ptr)
+        used_[ptr] = size;
+    return ptr;
+}
+
+void DeviceCache::release_split(std::map<char*, Block>::iterator it) {
+    it->second.free = true;
+
+    // Merge with the next block, then with the previous one, if they are free and in the same chunk
+    auto next = std::next(it);
+    if (next != blocks_.end() && next->second.free && next->second.chunk == it->second.chunk) {
+        remove_free(next->first, next->second.size);
+        it->second.size += next->second.size;
+        blocks_.erase(next);
+    }
+    if (it != blocks_.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second.free && prev->second.chunk == it->second.chunk) {
+            remove_free(prev->first, prev->second.size);
+            prev->second.size += it->second.size;
+            blocks_.erase(it);
+            it = prev;
+        }
+    }
+    free_blocks_.emplace(it->second.size, it->first);
+}
+
+void DeviceCache::remove_free(char* ptr, int64_t size) {
+    auto range = free_blocks_.equal_range(size);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == ptr) {
+            free_blocks_.erase(it);
+            return;
+        }
+    }
+    assert(0 && "Free block not found");
+}
@@ -0,0 +1,56 @@
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+/// Caching sub-allocator on top of the allocator of a device.
+/// Memory is obtained from the device in large chunks, split into blocks on demand, and released blocks
+/// are merged with their free neighbours and kept for reuse until the cache is trimmed.
+/// When device allocations are opaque handles (OpenCL buffers), they cannot be split: whole allocations are cached by size instead.
+class DeviceCache {
+public:
+    typedef std::function<void* (int64_t)> AllocFn;
+    typedef std::function<void (void*)> ReleaseFn;
+
+    DeviceCache(AllocFn alloc, ReleaseFn release, bool splittable);
+    ~DeviceCache();
+
+    /// Allocates size bytes, aligned to 256 bytes if allocations are split.
+    void* alloc(int64_t size);
+    /// Releases memory obtained from alloc. Returns false if the memory does not come from this cache.
+    bool release(void* ptr);
+    /// Returns the unused memory to the device.
+    void trim();
+
+private:
+    struct Block {
+        int64_t size;
+        char* chunk;
+        bool free;
+    };
+
+    void* alloc_split(int64_t size);
+    void* alloc_whole(int64_t size);
+    void release_split(std::map<char*, Block>::iterator it);
+    void remove_free(char* ptr, int64_t size);
+
+    AllocFn alloc_;
+    ReleaseFn release_;
+    bool splittable_;
+    std::mutex mutex_;
+
+    // Split mode: every block of every chunk by address, free blocks by size, and the size of every chunk
+    std::map<char*, Block> blocks_;
+    std::multimap<int64_t, char*> free_blocks_;
+    std::unordered_map<char*, int64_t> chunks_;
+
+    // Whole mode: size of the allocations in use, and cached allocations by size
+    std::unordered_map<void*, int64_t> used_;
+    std::multimap<int64_t, void*> cached_;
+};
+
+#endif
@@ -31,6 +31,7 @@ protected:
     void copy(DeviceId, const void*, int64_t, DeviceId, void*, int64_t, int64_t) override { platform_error(); }
     void copy_from_host(const void*, int64_t, DeviceId, void*, int64_t, int64_t) override { platform_error(); }
     void copy_to_host(DeviceId, const void*, int64_t, void*, int64_t, int64_t) override { platform_error(); }
+    void fill(DeviceId, void*, int64_t, int64_t, uint32_t, int32_t) override { platform_error(); }
 
     // Maximum number of devices to prevent assertions in debug mode
     size_t dev_count() const override { return std::numeric_limits<size_t>::max(); }
@@ -0,0 +1,124 @@
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/// Table of at most Capacity objects referenced by integer handles. Allocation and release are lock-free.
+/// Slots are allocated in chunks on demand, so that large capacities only cost the memory actually used.
+/// Handles carry the generation of their slot, so that stale handles are detected once the slot is reused.
+template <typename T, size_t Capacity = 4096>
+class HandleTable {
+public:
+    HandleTable()
+        : free_(Capacity), size_(0)
+    {
+        for (size_t i = 0; i < num_chunks; i++)
+            chunks_[i] = nullptr;
+    }
+
+    ~HandleTable() {
+        for (size_t i = 0; i < num_chunks; i++)
+            delete[] chunks_[i].load(std::memory_order_relaxed);
+    }
+
+    /// Allocates a slot and returns its handle, or -1 if the table is full.
+    int32_t alloc() {
+        uint64_t head = free_.load(std::memory_order_acquire);
+        uint32_t index;
+        do {
+            index = uint32_t(head & 0xFFFFFFFF);
+            if (index == Capacity) {
+                index = grow();
+                if (index == Capacity) return -1;
+                break;
+            }
+            // The tag in the upper bits of the head prevents ABA issues when the slot is concurrently reused
+            uint64_t next = (((head >> 32) + 1) << 32) | slot(index).next.load(std::memory_order_relaxed);
+            if (free_.compare_exchange_weak(head, next, std::memory_order_acq_rel))
+                break;
+        } while (true);
+
+        // Odd generations mark slots in use
+        auto& s = slot(index);
+        uint32_t generation = s.generation.load(std::memory_order_relaxed) + 1;
+        s.generation.store(generation, std::memory_order_release);
+        return make_handle(generation, index);
+    }
+
+    /// Returns the object referenced by the handle, or nullptr if the handle is invalid or stale.
+    T* get(int32_t handle) {
+        if (handle < 0) return nullptr;
+        uint32_t index = uint32_t(handle) % Capacity;
+        auto chunk = chunks_[index / chunk_size].load(std::memory_order_acquire);
+        if (!chunk) return nullptr;
+        auto& s = chunk[index % chunk_size];
+        uint32_t generation = s.generation.load(std::memory_order_acquire);
+        if (!(generation & 1) || make_handle(generation, index) != handle)
+            return nullptr;
+        return &s.value;
+    }
+
+    /// Releases the slot of the handle, which must be valid.
+    void release(int32_t handle) {
+        uint32_t index = uint32_t(handle) % Capacity;
+        auto& s = slot(index);
+        s.generation.fetch_add(1, std::memory_order_release);
+
+        uint64_t head = free_.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            s.next.store(uint32_t(head & 0xFFFFFFFF), std::memory_order_relaxed);
+            next = (((head >> 32) + 1) << 32) | index;
+        } while (!free_.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+private:
+    static const size_t chunk_size = Capacity < 4096 ? Capacity : 4096;
+    static const size_t num_chunks = (Capacity + chunk_size - 1) / chunk_size;
+
+    struct Slot {
+        T value;
+        std::atomic<uint32_t> generation;
+        std::atomic<uint32_t> next;
+    };
+
+    // Handles are kept positive: the generation only uses the bits left by the index
+    static int32_t make_handle(uint32_t generation, uint32_t index) {
+        const uint32_t max_generation = uint32_t(INT32_MAX) / Capacity;
+        return int32_t((generation % max_generation) * Capacity + index);
+    }
+
+    Slot& slot(uint32_t index) {
+        return chunks_[index / chunk_size].load(std::memory_order_acquire)[index % chunk_size];
+    }
+
+    /// Takes a slot that was never used, allocating its chunk if needed. Returns Capacity if the table is full.
+    uint32_t grow() {
+        uint32_t index = size_.load(std::memory_order_relaxed);
+        do {
+            if (index == Capacity) return uint32_t(Capacity);
+        } while (!size_.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+        auto& chunk = chunks_[index / chunk_size];
+        if (!chunk.load(std::memory_order_acquire)) {
+            Slot* slots = new Slot[chunk_size];
+            for (size_t i = 0; i < chunk_size; i++)
+                slots[i].generation = 0;
+            // Another thread taking a slot of the same chunk may have installed it first
+            Slot* expected = nullptr;
+            if (!chunk.compare_exchange_strong(expected, slots, std::memory_order_acq_rel))
+                delete[] slots;
+        }
+        return index;
+    }
+
+    std::atomic<Slot*> chunks_[num_chunks];
+    // Tag in the upper 32 bits, index of the first free slot in the lower 32 bits (Capacity if none)
+    std::atomic<uint64_t> free_;
+    // Number of slots taken at least once, slots below it are handed out through the free list
+    std::atomic<uint32_t> size_;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "host_cache.h"
+
+#include <algorithm>
+
+#include "anydsl_runtime.h"
+
+static const int64_t min_class_size = 4096;
+static const int64_t huge_page_size = 2 * 1024 * 1024;
+
+static int size_class(int64_t size) {
+    int c = 0;
+    while ((min_class_size << c) < size) c++;
+    return c;
+}
+
+static int64_t class_size(int c) {
+    return min_class_size << c;
+}
+
+HostCache& HostCache::instance() {
+    static HostCache* cache = new HostCache();
+    return *cache;
+}
+
+HostCache::HostCache()
+    : limit_(0), retained_(0)
+{}
+
+HostCache::ThreadCache::ThreadCache() {
+    auto& cache = instance();
+    std::lock_guard<std::mutex> lock(cache.mutex_);
+    cache.thread_caches_.push_back(this);
+}
+
+HostCache::ThreadCache::~ThreadCache() {
+    auto& cache = instance();
+    std::lock_guard<std::mutex> lock(cache.mutex_);
+    cache.thread_caches_.erase(std::find(cache.thread_caches_.begin(), cache.thread_caches_.end(), this));
+    for (int c = 0; c < num_classes; c++)
+        cache.shared_[c].insert(cache.shared_[c].end(), blocks[c], blocks[c] + count[c]);
+}
+
+HostCache::ThreadCache& HostCache::local_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+HostCache::Shard& HostCache::shard(void* ptr) {
+    // Large blocks are aligned to 64 KiB or more, so the low bits of the address are all zero:
+    // a multiplicative hash mixes the address into the top bits, which select the shard
+    uint64_t hash = uint64_t(reinterpret_cast<uintptr_t>(ptr)) * UINT64_C(0x9E3779B97F4A7C15);
+    return shards_[hash >> 60];
+}
+
+void HostCache::set_limit(int64_t limit) {
+    limit_ = std::max(limit, int64_t(0));
+}
+
+void* HostCache::alloc(int64_t size, bool& fresh) {
+    if (size > class_size(num_classes - 1))
+        return nullptr;
+
+    int c = size_class(size);
+    void* ptr = nullptr;
+    {
+        auto& local = local_cache();
+        std::lock_guard<std::mutex> lock(local.mutex);
+        if (local.count[c] > 0)
+            ptr = local.blocks[c][--local.count[c]];
+    }
+    if (!ptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!shared_[c].empty()) {
+            ptr = shared_[c].back();
+            shared_[c].pop_back();
+        }
+    }
+
+    fresh = !ptr;
+    if (ptr) {
+        retained_.fetch_sub(class_size(c), std::memory_order_relaxed);
+    } else {
+        // Large blocks are aligned to huge pages, which lets the platform request them for the block
+        ptr = anydsl_aligned_malloc(class_size(c), std::min(class_size(c), huge_page_size));
+        if (!ptr) return nullptr;
+    }
+
+    auto& s = shard(ptr);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.classes[ptr] = c;
+    return ptr;
+}
+
+void HostCache::release(void* ptr) {
+    if (!ptr) return;
+
+    int c;
+    {
+        auto& s = shard(ptr);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.classes.find(ptr);
+        if (it == s.classes.end()) {
+            // Allocated before caching was enabled
+            anydsl_aligned_free(ptr);
+            return;
+        }
+        c = it->second;
+        s.classes.erase(it);
+    }
+
+    const int64_t bytes = class_size(c);
+    if (retained_.fetch_add(bytes, std::memory_order_relaxed) + bytes > limit_.load(std::memory_order_relaxed)) {
+        retained_.fetch_sub(bytes, std::memory_order_relaxed);
+        anydsl_aligned_free(ptr);
+        return;
+    }
+
+    {
+        auto& local = local_cache();
+        std::lock_guard<std::mutex> lock(local.mutex);
+        if (local.count[c] < thread_cache_depth) {
+            local.blocks[c][local.count[c]++] = ptr;
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    shared_[c].push_back(ptr);
+}
+
+void HostCache::trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int c = 0; c < num_classes; c++) {
+        for (auto ptr : shared_[c])
+            anydsl_aligned_free(ptr);
+        retained_.fetch_sub(class_size(c) * shared_[c].size(), std::memory_order_relaxed);
+        shared_[c].clear();
+    }
+    for (auto local : thread_caches_) {
+        std::lock_guard<std::mutex> local_lock(local->mutex);
+        for (int c = 0; c < num_classes; c++) {
+            for (int i = 0; i < local->count[c]; i++)
+                anydsl_aligned_free(local->blocks[c][i]);
+            retained_.fetch_sub(class_size(c) * local->count[c], std::memory_order_relaxed);
+            local->count[c] = 0;
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef HOST_CACHE_H
+#define HOST_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Caching allocator for host memory. Sizes are rounded up to a power of two, and released blocks are
+/// kept for reuse: first in a small cache owned by the releasing thread, then in a cache shared by all threads.
+/// The memory retained by the caches is capped, blocks that would exceed the limit go back to the system.
+class HostCache {
+public:
+    /// Returns the process-wide cache. It is never destroyed, so that exiting threads can always hand their blocks over.
+    static HostCache& instance();
+
+    /// Sets the maximum number of bytes retained by the caches, 0 (the default) disables caching.
+    void set_limit(int64_t limit);
+    bool enabled() const { return limit_.load(std::memory_order_relaxed) > 0; }
+
+    /// Allocates at least size bytes aligned to 4096 bytes. Sets fresh if the memory comes from the system.
+    void* alloc(int64_t size, bool& fresh);
+    /// Releases memory obtained from alloc.
+    void release(void* ptr);
+    /// Returns the memory retained by the caches of all the threads to the system.
+    void trim();
+
+private:
+    static const int num_classes = 48;
+    static const int thread_cache_depth = 4;
+
+    struct ThreadCache {
+        std::mutex mutex;
+        void* blocks[num_classes][thread_cache_depth];
+        int count[num_classes] = {};
+
+        ThreadCache();
+        ~ThreadCache();
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        // Size class of every block handed out by alloc
+        std::unordered_map<void*, int> classes;
+    };
+
+    HostCache();
+
+    static ThreadCache& local_cache();
+    Shard& shard(void* ptr);
+
+    std::atomic<int64_t> limit_;
+    std::atomic<int64_t> retained_;
+    // Protects the shared cache and the list of thread caches
+    std::mutex mutex_;
+    std::vector<void*> shared_[num_classes];
+    std::vector<ThreadCache*> thread_caches_;
+    Shard shards_[16];
+};
+
+#endif
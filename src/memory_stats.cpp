@@ -0,0 +1,68 @@
+#include "memory_stats.h"
+
+// Index of the histogram bin of an allocation: floor(log2(size)), clamped to the last bin
+static int histogram_bin(int64_t size) {
+    int bin = 0;
+    while (bin < ANYDSL_MEMORY_HISTOGRAM_SIZE - 1 && (size >> (bin + 1)) > 0)
+        bin++;
+    return bin;
+}
+
+void MemoryCounters::add(int64_t size) {
+    int64_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    int64_t peak = peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) ;
+    live_allocs.fetch_add(1, std::memory_order_relaxed);
+    num_allocs.fetch_add(1, std::memory_order_relaxed);
+    histogram[histogram_bin(size)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void MemoryCounters::remove(int64_t size) {
+    live_bytes.fetch_sub(size, std::memory_order_relaxed);
+    live_allocs.fetch_sub(1, std::memory_order_relaxed);
+    num_releases.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MemoryCounters::read(MemoryStats* stats) const {
+    stats->live_bytes   = live_bytes.load(std::memory_order_relaxed);
+    stats->peak_bytes   = peak_bytes.load(std::memory_order_relaxed);
+    stats->live_allocs  = live_allocs.load(std::memory_order_relaxed);
+    stats->num_allocs   = num_allocs.load(std::memory_order_relaxed);
+    stats->num_releases = num_releases.load(std::memory_order_relaxed);
+    for (int i = 0; i < ANYDSL_MEMORY_HISTOGRAM_SIZE; i++)
+        stats->histogram[i] = histogram[i].load(std::memory_order_relaxed);
+}
+
+MemoryTracker::Shard& MemoryTracker::shard(void* ptr) {
+    // Allocations are aligned to pages or more, so the low bits are all zero:
+    // a multiplicative hash mixes the address into the top bits, which select the shard
+    uint64_t hash = uint64_t(reinterpret_cast<uintptr_t>(ptr)) * UINT64_C(0x9E3779B97F4A7C15);
+    return shards_[hash >> 60];
+}
+
+void MemoryTracker::record_alloc(void* ptr, int64_t size) {
+    if (!ptr)
+        return;
+    {
+        auto& s = shard(ptr);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.sizes[ptr] = size;
+    }
+    counters_.add(size);
+    platform_->add(size);
+}
+
+void MemoryTracker::record_release(void* ptr) {
+    int64_t size;
+    {
+        auto& s = shard(ptr);
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.sizes.find(ptr);
+        if (it == s.sizes.end())
+            return;
+        size = it->second;
+        s.sizes.erase(it);
+    }
+    counters_.remove(size);
+    platform_->remove(size);
+}
@@ -0,0 +1,53 @@
+#ifndef MEMORY_STATS_H
+#define MEMORY_STATS_H
+
+#include "anydsl_runtime.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+/// Allocation counters, updated with relaxed atomics: a snapshot taken while other threads allocate
+/// is not necessarily consistent across counters.
+struct MemoryCounters {
+    std::atomic<int64_t> live_bytes { 0 };
+    std::atomic<int64_t> peak_bytes { 0 };
+    std::atomic<int64_t> live_allocs { 0 };
+    std::atomic<int64_t> num_allocs { 0 };
+    std::atomic<int64_t> num_releases { 0 };
+    std::atomic<int64_t> histogram[ANYDSL_MEMORY_HISTOGRAM_SIZE] = {};
+
+    void add(int64_t size);
+    void remove(int64_t size);
+    void read(MemoryStats* stats) const;
+};
+
+/// Keeps track of the size of the live allocations of a device, and accounts for them in the counters
+/// of the device and of its platform.
+class MemoryTracker {
+public:
+    MemoryTracker(MemoryCounters* platform)
+        : platform_(platform)
+    {}
+
+    void record_alloc(void* ptr, int64_t size);
+    /// Does nothing if the memory was not recorded by record_alloc.
+    void record_release(void* ptr);
+
+    const MemoryCounters& counters() const { return counters_; }
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<void*, int64_t> sizes;
+    };
+
+    Shard& shard(void* ptr);
+
+    MemoryCounters counters_;
+    MemoryCounters* platform_;
+    Shard shards_[16];
+};
+
+#endif
@@ -352,6 +352,16 @@ void OpenCLPlatform::copy_to_host(DeviceId dev_src, const void* src, int64_t off
     CHECK_OPENCL(err, "clEnqueueReadBuffer()");
 }
 
+void OpenCLPlatform::fill(DeviceId dev, void* ptr, int64_t offset, int64_t size, uint32_t pattern, int32_t pattern_size) {
+#ifdef CL_VERSION_1_2
+    cl_int err = clEnqueueFillBuffer(devices_[dev].queue, (cl_mem)ptr, &pattern, pattern_size, offset, size, 0, NULL, NULL);
+    err |= clFinish(devices_[dev].queue);
+    CHECK_OPENCL(err, "clEnqueueFillBuffer()");
+#else
+    Platform::fill(dev, ptr, offset, size, pattern, pattern_size);
+#endif
+}
+
 cl_kernel OpenCLPlatform::load_kernel(DeviceId dev, const std::string& filename, const std::string& kernelname) {
     auto& opencl_dev = devices_[dev];
 
@@ -30,6 +30,8 @@ protected:
     void* get_device_ptr(DeviceId, void*) override { command_unavailable("get_device_ptr"); }
     void release(DeviceId dev, void* ptr) override;
     void release_host(DeviceId, void*) override { command_unavailable("release_host"); }
+    // Allocations are cl_mem handles
+    bool addressable_memory() const override { return false; }
 
     void launch_kernel(DeviceId dev,
                        const char* file, const char* kernel,
@@ -41,6 +43,7 @@ protected:
     void copy(DeviceId dev_src, const void* src, int64_t offset_src, DeviceId dev_dst, void* dst, int64_t offset_dst, int64_t size) override;
     void copy_from_host(const void* src, int64_t offset_src, DeviceId dev_dst, void* dst, int64_t offset_dst, int64_t size) override;
     void copy_to_host(DeviceId dev_src, const void* src, int64_t offset_src, void* dst, int64_t offset_dst, int64_t size) override;
+    void fill(DeviceId dev, void* ptr, int64_t offset, int64_t size, uint32_t pattern, int32_t pattern_size) override;
 
     size_t dev_count() const override { return devices_.size(); }
     std::string name() const override { return "OpenCL"; }
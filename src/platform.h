@@ -3,8 +3,10 @@
 
 #include "log.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 class Runtime;
 enum DeviceId   : uint32_t {};
@@ -24,6 +26,8 @@ public:
 
     /// Allocates memory for a device on this platform.
     virtual void* alloc(DeviceId dev, int64_t size) = 0;
+    /// Allocates memory for a device on this platform, with ANYDSL_ALLOC_* flags. Unsupported flags are ignored.
+    virtual void* alloc_flags(DeviceId dev, int64_t size, int32_t) { return alloc(dev, size); }
     /// Allocates page-locked host memory for a platform (and a device).
     virtual void* alloc_host(DeviceId dev, int64_t size) = 0;
     /// Allocates unified memory for a platform (and a device).
@@ -34,6 +38,12 @@ public:
     virtual void release(DeviceId dev, void* ptr) = 0;
     /// Releases page-locked host memory for a device on this platform.
     virtual void release_host(DeviceId dev, void* ptr) = 0;
+    /// Returns the memory kept for reuse by the allocator of a device to the system.
+    virtual void trim(DeviceId) {}
+    /// Maps a file in memory with ANYDSL_MAP_* flags, the memory is unmapped by release. Sets size to the size of the file.
+    virtual void* map_file(DeviceId, const char*, int32_t, int64_t&) { command_unavailable("map_file"); }
+    /// Returns true if memory returned by alloc supports pointer arithmetic, so that it can be sub-allocated.
+    virtual bool addressable_memory() const { return true; }
 
     /// Launches a kernel with the given block/grid size and arguments.
     virtual void launch_kernel(DeviceId dev,
@@ -50,6 +60,16 @@ public:
     virtual void copy_from_host(const void* src, int64_t offset_src, DeviceId dev_dst, void* dst, int64_t offset_dst, int64_t size) = 0;
     /// Copies memory to the host (CPU).
     virtual void copy_to_host(DeviceId dev_src, const void* src, int64_t offset_src, void* dst, int64_t offset_dst, int64_t size) = 0;
+    /// Fills memory with a pattern of pattern_size bytes (1 or 4), given in the low bytes of pattern.
+    /// By default, the pattern is repeated in a host buffer which is copied to the device.
+    virtual void fill(DeviceId dev, void* ptr, int64_t offset, int64_t size, uint32_t pattern, int32_t pattern_size) {
+        if (pattern_size == 1)
+            pattern = (pattern & 0xFF) * 0x01010101u;
+        const int64_t buffer_size = fill_buffer_size;
+        std::vector<uint32_t> buffer(std::min(size, buffer_size) / 4 + 1, pattern);
+        for (int64_t i = 0; i < size; i += buffer_size)
+            copy_from_host(buffer.data(), 0, dev, ptr, offset + i, std::min(size - i, buffer_size));
+    }
 
     /// Returns the number of devices in this platform.
     virtual size_t dev_count() const = 0;
@@ -57,6 +77,8 @@ public:
     virtual std::string name() const = 0;
 
 protected:
+    static const int64_t fill_buffer_size = 1024 * 1024;
+
     [[noreturn]] void platform_error() {
         error("The selected '%' platform is not available", name());
     }
@@ -3,10 +3,14 @@
 #include <cassert>
 #include <chrono>
 #include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <limits>
 #include <locale>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -19,14 +23,15 @@
 #include <tbb/flow_graph.h>
 #include <tbb/tbb.h>
 #include <tbb/parallel_for.h>
-#include <tbb/task_scheduler_init.h>
-#else
-#include <thread>
+#include <tbb/task_arena.h>
 #endif
 
 #include "anydsl_runtime.h"
 
+#include "handle_table.h"
 #include "runtime.h"
+#include "scratch_arena.h"
+#include "stream_loader.h"
 #include "platform.h"
 #include "cpu_platform.h"
 #include "dummy_platform.h"
@@ -45,16 +50,85 @@ Runtime& runtime() {
     return *runtime;
 }
 
-Runtime::Runtime() {
-    profile_ = ProfileLevel::None;
-    char* env_var = std::getenv("ANYDSL_PROFILE");
-    if (env_var) {
-        std::string env_str = env_var;
+// Returns the value of the environment variable in upper case, or an empty string
+static std::string get_env_upper(const char* name) {
+    std::string env_str;
+    if (char* env_var = std::getenv(name)) {
+        env_str = env_var;
         for (auto& c: env_str)
             c = std::toupper(c, std::locale());
-        if (env_str == "FULL")
-            profile_ = ProfileLevel::Full;
     }
+    return env_str;
+}
+
+// Loop settings from the environment, read once without initializing the platforms
+struct LoopConfig {
+    Schedule schedule;
+    int32_t grain;
+
+    LoopConfig() {
+        // Same syntax as OMP_SCHEDULE: kind[,grain]
+        schedule = Schedule::Static;
+        grain = 0;
+        std::string env = get_env_upper("ANYDSL_SCHEDULE");
+        auto comma = env.find(',');
+        auto kind = env.substr(0, comma);
+        if (kind == "DYNAMIC")
+            schedule = Schedule::Dynamic;
+        if (kind == "GUIDED")
+            schedule = Schedule::Guided;
+        if (comma != std::string::npos)
+            grain = std::max(std::atoi(env.c_str() + comma + 1), 0);
+
+        std::string affinity = get_env_upper("ANYDSL_THREAD_AFFINITY");
+#ifndef RUNTIME_ENABLE_TBB
+        if (affinity == "COMPACT")
+            ThreadPool::instance().set_affinity(Affinity::Compact);
+        if (affinity == "SCATTER")
+            ThreadPool::instance().set_affinity(Affinity::Scatter);
+        if (affinity == "NODE")
+            ThreadPool::instance().set_affinity(Affinity::Node);
+#else
+        // Loops run on the workers of TBB, which the runtime does not pin
+        if (!affinity.empty())
+            info("ANYDSL_THREAD_AFFINITY is ignored when the runtime is built with TBB");
+#endif
+    }
+};
+
+static const LoopConfig& loop_config() {
+    static LoopConfig config;
+    return config;
+}
+
+Runtime::Runtime() {
+    profile_ = ProfileLevel::None;
+    if (get_env_upper("ANYDSL_PROFILE") == "FULL")
+        profile_ = ProfileLevel::Full;
+
+    loop_config();
+
+    first_touch_ = get_env_upper("ANYDSL_CPU_ALLOC") == "FIRST_TOUCH";
+
+    huge_pages_ = HugePages::Madvise;
+    std::string huge_pages = get_env_upper("ANYDSL_HUGE_PAGES");
+    if (huge_pages == "NEVER")
+        huge_pages_ = HugePages::Never;
+    if (huge_pages == "HUGETLB")
+        huge_pages_ = HugePages::HugeTLB;
+
+    // Thresholds for parallel and streaming host copies, in KiB
+    parallel_copy_threshold_ = int64_t(4) << 20;
+    streaming_copy_threshold_ = int64_t(32) << 20;
+    std::string parallel_copy = get_env_upper("ANYDSL_PARALLEL_COPY");
+    if (!parallel_copy.empty())
+        parallel_copy_threshold_ = int64_t(std::max(std::atoi(parallel_copy.c_str()), 0)) << 10;
+    std::string streaming_copy = get_env_upper("ANYDSL_STREAMING_COPY");
+    if (!streaming_copy.empty())
+        streaming_copy_threshold_ = int64_t(std::max(std::atoi(streaming_copy.c_str()), 0)) << 10;
+
+    // Maximum amount of released host memory kept for reuse, in MiB
+    HostCache::instance().set_limit(int64_t(std::atoi(get_env_upper("ANYDSL_CPU_CACHE").c_str())) << 20);
 
     register_platform<CpuPlatform>();
 #ifdef RUNTIME_ENABLE_CUDA
@@ -72,6 +146,36 @@ Runtime::Runtime() {
 #else
     register_platform<DummyPlatform>("HSA");
 #endif
+
+    // Comma-separated list of platform names, or ALL
+    std::string device_cache = "," + get_env_upper("ANYDSL_DEVICE_CACHE") + ",";
+    for (auto p: platforms_) {
+        std::string name = p->name();
+        for (auto& c: name)
+            c = std::toupper(c, std::locale());
+        cached_platforms_.push_back(device_cache == ",ALL," || device_cache.find("," + name + ",") != std::string::npos);
+    }
+
+    for (auto p: platforms_) {
+        platform_memory_.emplace_back(new MemoryCounters());
+        memory_trackers_.emplace_back();
+        // Unavailable platforms accept any device number
+        size_t num_devs = p->dev_count() == std::numeric_limits<size_t>::max() ? 0 : p->dev_count();
+        for (size_t dev = 0; dev < num_devs; dev++)
+            memory_trackers_.back().emplace_back(new MemoryTracker(platform_memory_.back().get()));
+    }
+}
+
+void Runtime::report_leaks() {
+    for (size_t plat = 0; plat < platforms_.size(); plat++) {
+        for (size_t dev = 0; dev < memory_trackers_[plat].size(); dev++) {
+            MemoryStats stats;
+            memory_trackers_[plat][dev]->counters().read(&stats);
+            if (stats.live_allocs > 0)
+                info("Memory leak on % device %: % bytes in % allocation(s) (peak: % bytes, % allocation(s) in total)",
+                     platforms_[plat]->name(), dev, stats.live_bytes, stats.live_allocs, stats.peak_bytes, stats.num_allocs);
+        }
+    }
 }
 
 inline PlatformId to_platform(int32_t m) {
@@ -90,6 +194,10 @@ void* anydsl_alloc(int32_t mask, int64_t size) {
     return runtime().alloc(to_platform(mask), to_device(mask), size);
 }
 
+void* anydsl_alloc_flags(int32_t mask, int64_t size, int32_t flags) {
+    return runtime().alloc_flags(to_platform(mask), to_device(mask), size, flags);
+}
+
 void* anydsl_alloc_host(int32_t mask, int64_t size) {
     return runtime().alloc_host(to_platform(mask), to_device(mask), size);
 }
@@ -98,6 +206,26 @@ void* anydsl_alloc_unified(int32_t mask, int64_t size) {
     return runtime().alloc_unified(to_platform(mask), to_device(mask), size);
 }
 
+void anydsl_trim(int32_t mask) {
+    runtime().trim(to_platform(mask), to_device(mask));
+}
+
+void* anydsl_map_file(const char* path, int32_t flags, int64_t* size) {
+    int64_t file_size = 0;
+    void* ptr = runtime().map_file(path, flags, file_size);
+    if (size)
+        *size = file_size;
+    return ptr;
+}
+
+void anydsl_memory_stats(int32_t mask, MemoryStats* stats) {
+    runtime().memory_stats(to_platform(mask), to_device(mask), stats);
+}
+
+void anydsl_platform_memory_stats(int32_t plat, MemoryStats* stats) {
+    runtime().platform_memory_stats(to_platform(plat), stats);
+}
+
 void* anydsl_get_device_ptr(int32_t mask, void* ptr) {
     return runtime().get_device_ptr(to_platform(mask), to_device(mask), ptr);
 }
@@ -116,6 +244,118 @@ void anydsl_copy(int32_t mask_src, const void* src, int64_t offset_src,
                    to_platform(mask_dst), to_device(mask_dst), dst, offset_dst, size);
 }
 
+void anydsl_memset(int32_t mask, void* ptr, int64_t offset, int32_t value, int64_t size) {
+    runtime().fill(to_platform(mask), to_device(mask), ptr, offset, size, uint32_t(value) & 0xFF, 1);
+}
+
+void anydsl_fill(int32_t mask, void* ptr, int64_t offset, uint32_t pattern, int64_t size) {
+    runtime().fill(to_platform(mask), to_device(mask), ptr, offset, size, pattern, 4);
+}
+
+// Default number of staging buffers: one per stage, and one more so that reading can run ahead
+static const int32_t default_stream_depth = 3;
+static const int64_t default_stream_chunk = 16 * 1024 * 1024;
+
+static void print_stream_stats(const StreamStats& stats) {
+    auto throughput = [&] (int64_t time) { return time > 0 ? double(stats.bytes) / double(time) : 0.0; };
+    info("Streamed % bytes in % us: read % MB/s, copy % MB/s, copy and process % MB/s, overall % MB/s",
+         stats.bytes, stats.total_time,
+         throughput(stats.read_time), throughput(stats.copy_time),
+         throughput(stats.process_time), throughput(stats.total_time));
+}
+
+void anydsl_stream_file(int32_t mask, const char* path, int64_t chunk_size, int32_t depth, void* args, void* fun, StreamStats* stats) {
+    StreamStats local_stats;
+    StreamLoader loader(mask, chunk_size > 0 ? chunk_size : default_stream_chunk, depth > 0 ? depth : default_stream_depth);
+    loader.run_file(path, args, reinterpret_cast<StreamLoader::ChunkFn>(fun), &local_stats);
+    if (runtime().profiling_enabled())
+        print_stream_stats(local_stats);
+    if (stats)
+        *stats = local_stats;
+}
+
+void anydsl_stream_host(int32_t mask, const void* src, int64_t size, int64_t chunk_size, int32_t depth, void* args, void* fun, StreamStats* stats) {
+    StreamStats local_stats;
+    StreamLoader loader(mask, chunk_size > 0 ? chunk_size : default_stream_chunk, depth > 0 ? depth : default_stream_depth);
+    loader.run_host(src, size, args, reinterpret_cast<StreamLoader::ChunkFn>(fun), &local_stats);
+    if (runtime().profiling_enabled())
+        print_stream_stats(local_stats);
+    if (stats)
+        *stats = local_stats;
+}
+
+// Host memory regions: allocations bump a pointer in the current block, and are all released at once.
+// Blocks are kept on reset, so that an arena reused for every iteration of a host stage stops allocating.
+struct HostArena {
+    struct Block {
+        char* data;
+        int64_t size;
+    };
+
+    std::mutex mutex;
+    std::vector<Block> blocks;
+    size_t block;
+    int64_t offset;
+    int64_t block_size;
+};
+
+static HandleTable<HostArena> host_arena_pool;
+static const int64_t arena_alignment = 64;
+static const int64_t default_arena_block = 4 * 1024 * 1024;
+
+static HostArena* find_host_arena(int32_t id) {
+    auto arena = host_arena_pool.get(id);
+    if (!arena)
+        assert(0 && "Trying to use invalid arena");
+    return arena;
+}
+
+int32_t anydsl_create_arena(int64_t block_size) {
+    int32_t id = host_arena_pool.alloc();
+    if (id < 0)
+        error("Too many arenas");
+    auto arena = host_arena_pool.get(id);
+    arena->block = 0;
+    arena->offset = 0;
+    arena->block_size = block_size > 0 ? block_size : default_arena_block;
+    return id;
+}
+
+void anydsl_destroy_arena(int32_t id) {
+    auto arena = find_host_arena(id);
+    for (auto& block : arena->blocks)
+        runtime().release(PlatformId(0), DeviceId(0), block.data);
+    arena->blocks.clear();
+    host_arena_pool.release(id);
+}
+
+void* anydsl_arena_alloc(int32_t id, int64_t size) {
+    auto arena = find_host_arena(id);
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    int64_t bytes = (std::max(size, int64_t(1)) + arena_alignment - 1) & ~(arena_alignment - 1);
+    if (arena->blocks.empty() || arena->offset + bytes > arena->blocks[arena->block].size) {
+        // Move to the next kept block if it is large enough, otherwise insert a new one there
+        size_t next = arena->blocks.empty() ? 0 : arena->block + 1;
+        if (next == arena->blocks.size() || arena->blocks[next].size < bytes) {
+            int64_t block_size = std::max(bytes, arena->block_size);
+            auto data = static_cast<char*>(runtime().alloc(PlatformId(0), DeviceId(0), block_size));
+            arena->blocks.insert(arena->blocks.begin() + next, HostArena::Block { data, block_size });
+        }
+        arena->block = next;
+        arena->offset = 0;
+    }
+    void* ptr = arena->blocks[arena->block].data + arena->offset;
+    arena->offset += bytes;
+    return ptr;
+}
+
+void anydsl_arena_reset(int32_t id) {
+    auto arena = find_host_arena(id);
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    arena->block = 0;
+    arena->offset = 0;
+}
+
 void anydsl_launch_kernel(int32_t mask,
                           const char* file, const char* kernel,
                           const uint32_t* grid, const uint32_t* block,
@@ -201,137 +441,677 @@ uint64_t anydsl_random_val_u64() {
     return std_dist_u64(std_gen);
 }
 
-#ifndef RUNTIME_ENABLE_TBB // C++11 threads version
-static std::unordered_map<int32_t, std::thread> thread_pool;
-static std::vector<int32_t> free_ids;
+void* anydsl_worker_scratch(int64_t size) {
+    return ScratchArena::local().alloc(size);
+}
 
 void anydsl_parallel_for(int32_t num_threads, int32_t lower, int32_t upper, void* args, void* fun) {
-    // Get number of available hardware threads
-    if (num_threads == 0) {
-        num_threads = std::thread::hardware_concurrency();
-        // hardware_concurrency is implementation defined, may return 0
-        num_threads = (num_threads == 0) ? 1 : num_threads;
+    auto& config = loop_config();
+    anydsl_parallel_for_schedule(num_threads, lower, upper, int32_t(config.schedule), config.grain, args, fun);
+}
+
+// Default tile sizes, chosen so that a tile of 4-byte elements fits in the L1 cache and a few in the L2 cache
+static const int32_t default_tile_2d[] = { 64, 64 };
+static const int32_t default_tile_3d[] = { 32, 16, 16 };
+
+struct TiledLoop {
+    int dims;
+    int32_t lower[3];
+    int32_t upper[3];
+    int32_t tile_size[3];
+    int32_t num_tiles[3];
+    void* args;
+    void* fun;
+};
+
+// Finds the coordinates of the tile at the given position along a Z-order curve generalized to grids
+// of any shape: every dimension at least half as large as the largest one is split in halves, and
+// the resulting blocks are visited with the first dimension varying fastest.
+// The Impala skeletons in intrinsics_thorin.impala visit the tiles in the same order.
+static void morton_tile(int64_t index, int dims, const int32_t* num_tiles, int32_t* tile) {
+    int32_t extent[3];
+    for (int d = 0; d < dims; d++) {
+        tile[d] = 0;
+        extent[d] = num_tiles[d];
     }
 
-    void (*fun_ptr) (void*, int32_t, int32_t) = reinterpret_cast<void (*) (void*, int32_t, int32_t)>(fun);
-    const int32_t linear = (upper - lower) / num_threads;
+    while (true) {
+        int32_t max_extent = *std::max_element(extent, extent + dims);
+        if (max_extent <= 1)
+            break;
 
-    // Create a pool of threads to execute the task
-    std::vector<std::thread> pool(num_threads);
+        int32_t half[3];
+        for (int d = 0; d < dims; d++)
+            half[d] = extent[d] > 1 && 2 * extent[d] >= max_extent ? extent[d] / 2 : extent[d];
 
-    for (int i = 0, a = lower, b = lower + linear; i < num_threads - 1; a = b, b += linear, i++) {
-        pool[i] = std::thread([=]() {
-            fun_ptr(args, a, b);
-        });
+        for (int child = 0; child < (1 << dims); child++) {
+            int32_t child_extent[3];
+            int64_t size = 1;
+            for (int d = 0; d < dims; d++) {
+                child_extent[d] = child & (1 << d) ? extent[d] - half[d] : half[d];
+                size *= child_extent[d];
+            }
+            if (index < size) {
+                for (int d = 0; d < dims; d++) {
+                    if (child & (1 << d)) tile[d] += half[d];
+                    extent[d] = child_extent[d];
+                }
+                break;
+            }
+            index -= size;
+        }
     }
+}
 
-    pool[num_threads - 1] = std::thread([=]() {
-        fun_ptr(args, lower + (num_threads - 1) * linear, upper);
-    });
+static void run_tiles(void* data, int32_t first, int32_t last) {
+    auto& loop = *static_cast<TiledLoop*>(data);
+    for (int32_t i = first; i < last; i++) {
+        int32_t tile[3], begin[3], end[3];
+        morton_tile(i, loop.dims, loop.num_tiles, tile);
+        for (int d = 0; d < loop.dims; d++) {
+            begin[d] = loop.lower[d] + tile[d] * loop.tile_size[d];
+            end[d] = std::min(int64_t(begin[d]) + loop.tile_size[d], int64_t(loop.upper[d]));
+        }
 
-    // Wait for all the threads to finish
-    for (int i = 0; i < num_threads; i++)
-        pool[i].join();
+        if (loop.dims == 2) {
+            auto fun = reinterpret_cast<void (*) (void*, int32_t, int32_t, int32_t, int32_t)>(loop.fun);
+            fun(loop.args, begin[0], end[0], begin[1], end[1]);
+        } else {
+            auto fun = reinterpret_cast<void (*) (void*, int32_t, int32_t, int32_t, int32_t, int32_t, int32_t)>(loop.fun);
+            fun(loop.args, begin[0], end[0], begin[1], end[1], begin[2], end[2]);
+        }
+    }
 }
 
-int32_t anydsl_spawn_thread(void* args, void* fun) {
-    int32_t (*fun_ptr) (void*) = reinterpret_cast<int32_t (*) (void*)>(fun);
+static void parallel_for_tiles(int32_t num_threads, TiledLoop& loop, const int32_t* default_tile) {
+    int64_t num_tiles = 1;
+    for (int d = 0; d < loop.dims; d++) {
+        if (loop.upper[d] <= loop.lower[d])
+            return;
+        if (loop.tile_size[d] <= 0)
+            loop.tile_size[d] = default_tile[d];
+        int64_t extent = int64_t(loop.upper[d]) - loop.lower[d];
+        loop.tile_size[d] = int32_t(std::min(int64_t(loop.tile_size[d]), extent));
+        loop.num_tiles[d] = int32_t((extent + loop.tile_size[d] - 1) / loop.tile_size[d]);
+        num_tiles *= loop.num_tiles[d];
+    }
+    if (num_tiles > INT32_MAX)
+        error("Too many tiles in parallel loop: %, increase the tile size", num_tiles);
+
+    // Consecutive tiles are close to each other, so that each thread works on a compact region
+    anydsl_parallel_for(num_threads, 0, int32_t(num_tiles), &loop, reinterpret_cast<void*>(run_tiles));
+}
+
+void anydsl_parallel_for_2d(int32_t num_threads,
+                            int32_t lower_x, int32_t upper_x,
+                            int32_t lower_y, int32_t upper_y,
+                            int32_t tile_x, int32_t tile_y,
+                            void* args, void* fun) {
+    TiledLoop loop = { 2, { lower_x, lower_y }, { upper_x, upper_y }, { tile_x, tile_y }, {}, args, fun };
+    parallel_for_tiles(num_threads, loop, default_tile_2d);
+}
+
+void anydsl_parallel_for_3d(int32_t num_threads,
+                            int32_t lower_x, int32_t upper_x,
+                            int32_t lower_y, int32_t upper_y,
+                            int32_t lower_z, int32_t upper_z,
+                            int32_t tile_x, int32_t tile_y, int32_t tile_z,
+                            void* args, void* fun) {
+    TiledLoop loop = { 3, { lower_x, lower_y, lower_z }, { upper_x, upper_y, upper_z }, { tile_x, tile_y, tile_z }, {}, args, fun };
+    parallel_for_tiles(num_threads, loop, default_tile_3d);
+}
+
+struct Reduction {
+    int32_t lower;
+    int32_t num_blocks;
+    int64_t range;
+    size_t stride;
+    char* partials;
+    std::atomic<int32_t>* arrived;
+    void* result;
+    int32_t size;
+    void* args;
+    void* fun;
+    void* combine;
+};
+
+// Blocks are combined pairwise along a binary tree: the second of two siblings to complete merges
+// the right partial into the left one and moves up. The combination order does not depend on the
+// scheduling, so that floating-point reductions are reproducible.
+static void run_reduction(void* data, int32_t first, int32_t last) {
+    auto& red = *static_cast<Reduction*>(data);
+    auto fun = reinterpret_cast<void (*) (void*, int32_t, int32_t, void*)>(red.fun);
+    auto combine = reinterpret_cast<void (*) (void*, void*, const void*)>(red.combine);
+
+    for (int32_t block = first; block < last; block++) {
+        // Block boundaries split the range evenly, computed in 64 bits so that they cannot overflow
+        int32_t begin = int32_t(red.lower + block * red.range / red.num_blocks);
+        int32_t end = int32_t(red.lower + (block + 1) * red.range / red.num_blocks);
+        fun(red.args, begin, end, red.partials + block * red.stride);
+
+        int32_t index = block;
+        int32_t step = 1;
+        for (; step < red.num_blocks; step *= 2) {
+            int32_t left = index & ~(2 * step - 1);
+            int32_t right = left + step;
+            if (right < red.num_blocks) {
+                // Inner nodes are numbered in-order, which gives each of them a unique index below num_blocks
+                if (red.arrived[left + step - 1].fetch_add(1, std::memory_order_acq_rel) == 0)
+                    break;
+                combine(red.args, red.partials + left * red.stride, red.partials + right * red.stride);
+            }
+            index = left;
+        }
+        if (step >= red.num_blocks)
+            std::copy(red.partials, red.partials + red.size, static_cast<char*>(red.result));
+    }
+}
+
+void anydsl_parallel_reduce(int32_t num_threads, int32_t lower, int32_t upper,
+                            void* result, int32_t size,
+                            void* args, void* fun, void* combine) {
+    if (upper <= lower)
+        return;
+
+    // The number of blocks only depends on the arguments, not on the machine
+    const int32_t min_blocks = 256;
+    int64_t range = int64_t(upper) - lower;
+    int32_t num_blocks = int32_t(std::min(range, int64_t(std::max(min_blocks, 4 * num_threads))));
+
+    // Each partial starts on its own cache line
+    const size_t cache_line = 64;
+    size_t stride = (size_t(size) + cache_line - 1) / cache_line * cache_line;
+    std::unique_ptr<char, void (*) (void*)> partials(
+        static_cast<char*>(anydsl_aligned_malloc(stride * num_blocks, cache_line)), anydsl_aligned_free);
+    std::unique_ptr<std::atomic<int32_t>[]> arrived(new std::atomic<int32_t>[num_blocks]);
+    for (int32_t i = 0; i < num_blocks; i++) {
+        std::copy(static_cast<char*>(result), static_cast<char*>(result) + size, partials.get() + i * stride);
+        arrived[i] = 0;
+    }
+
+    Reduction red = {
+        lower, num_blocks, range,
+        stride, partials.get(), arrived.get(),
+        result, size, args, fun, combine
+    };
+    anydsl_parallel_for_schedule(num_threads, 0, num_blocks, ANYDSL_SCHEDULE_STATIC, 0, &red, reinterpret_cast<void*>(run_reduction));
+}
+
+struct CancelToken {
+    std::atomic<bool> cancelled;
+    // Time in microseconds (as given by anydsl_get_micro_time) after which the token is cancelled
+    std::atomic<int64_t> deadline;
+    // Number of loop iterations, tasks and graph nodes skipped because of the token
+    std::atomic<int64_t> skipped;
+};
+
+static HandleTable<CancelToken> token_pool;
+
+static CancelToken* find_token(int32_t id) {
+    if (id < 0)
+        return nullptr;
+    auto token = token_pool.get(id);
+    if (!token)
+        assert(0 && "Trying to use invalid cancellation token");
+    return token;
+}
+
+static bool is_cancelled(CancelToken* token) {
+    if (!token)
+        return false;
+    if (token->cancelled.load(std::memory_order_relaxed))
+        return true;
+    int64_t deadline = token->deadline.load(std::memory_order_relaxed);
+    if (deadline != INT64_MAX && int64_t(anydsl_get_micro_time()) >= deadline) {
+        token->cancelled.store(true, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+static void skip_work(CancelToken* token, int64_t amount) {
+    token->skipped.fetch_add(amount, std::memory_order_relaxed);
+}
+
+int32_t anydsl_create_token() {
+    int32_t id = token_pool.alloc();
+    if (id < 0)
+        error("Too many cancellation tokens");
+    auto token = token_pool.get(id);
+    token->cancelled = false;
+    token->deadline = INT64_MAX;
+    token->skipped = 0;
+    return id;
+}
+
+void anydsl_destroy_token(int32_t id) {
+    find_token(id);
+    token_pool.release(id);
+}
+
+void anydsl_cancel(int32_t id) {
+    find_token(id)->cancelled.store(true, std::memory_order_relaxed);
+}
+
+void anydsl_set_deadline(int32_t id, int64_t deadline) {
+    find_token(id)->deadline.store(deadline, std::memory_order_relaxed);
+}
+
+int32_t anydsl_is_cancelled(int32_t id) {
+    return is_cancelled(find_token(id)) ? 1 : 0;
+}
+
+int64_t anydsl_skipped_work(int32_t id) {
+    return find_token(id)->skipped.load(std::memory_order_relaxed);
+}
+
+struct CancellableLoop {
+    CancelToken* token;
+    int32_t piece;
+    void* args;
+    void* fun;
+};
+
+static void run_cancellable(void* data, int32_t lower, int32_t upper) {
+    auto& loop = *static_cast<CancellableLoop*>(data);
+    auto fun = reinterpret_cast<void (*) (void*, int32_t, int32_t)>(loop.fun);
+    for (int32_t begin = lower; begin < upper; ) {
+        if (is_cancelled(loop.token)) {
+            skip_work(loop.token, int64_t(upper) - begin);
+            return;
+        }
+        int32_t end = int32_t(std::min(int64_t(begin) + loop.piece, int64_t(upper)));
+        fun(loop.args, begin, end);
+        begin = end;
+    }
+}
+
+void anydsl_parallel_for_cancellable(int32_t num_threads, int32_t lower, int32_t upper,
+                                     int32_t schedule, int32_t grain, int32_t token,
+                                     void* args, void* fun) {
+    auto cancel_token = find_token(token);
+    if (!cancel_token) {
+        anydsl_parallel_for_schedule(num_threads, lower, upper, schedule, grain, args, fun);
+        return;
+    }
+
+    // Chunks are split in pieces so that large chunks stop soon after cancellation
+    const int64_t num_pieces = 256;
+    CancellableLoop loop = {
+        cancel_token, int32_t(std::max(int64_t(1), (int64_t(upper) - lower) / num_pieces)), args, fun
+    };
+    anydsl_parallel_for_schedule(num_threads, lower, upper, schedule, grain, &loop, reinterpret_cast<void*>(run_cancellable));
+}
+
+#ifndef RUNTIME_ENABLE_TBB // C++11 threads version
+void anydsl_parallel_for_schedule(int32_t num_threads, int32_t lower, int32_t upper,
+                                  int32_t schedule, int32_t grain, void* args, void* fun) {
+    auto& pool = ThreadPool::instance();
+
+    // Use all the threads of the pool by default
+    if (num_threads == 0)
+        num_threads = int32_t(pool.num_threads());
+
+    pool.parallel_for(num_threads, lower, upper, Schedule(schedule), grain, args, reinterpret_cast<ThreadPool::RangeFn>(fun));
+}
+
+static void submit_task(void (*fun)(void*), void* data) {
+    ThreadPool::instance().submit(fun, data);
+}
+
+static void wait_until(bool (*done)(void*), void* data) {
+    ThreadPool::instance().help_until(done, data);
+}
+
+// Threads helping in wait_until() check their condition between tasks
+static void notify_waiters() {}
 
+struct FlowGraph;
+
+struct FlowNode {
+    Closure closure;
+    FlowGraph* graph;
+    int32_t num_predecessors;
+    std::atomic<int32_t> counter;
+    // Indices of the successors in the nodes of the graph
+    std::vector<int32_t> successors;
+
+    FlowNode() {}
+    FlowNode(const FlowNode&) = delete;
+    FlowNode(FlowNode&& node)
+        : closure(node.closure)
+        , graph(node.graph)
+        , num_predecessors(node.num_predecessors)
+        , counter(node.counter.load())
+        , successors(std::move(node.successors))
+    {}
+};
+
+struct FlowGraph {
+    std::vector<FlowNode> nodes;
+    // Ids of the nodes, released with the graph
+    std::vector<int32_t> node_ids;
+    // Number of chains of nodes still running
+    std::atomic<int32_t> pending;
+    // Token of the current execution, or nullptr
+    CancelToken* token;
+};
+
+struct FlowNodeRef {
+    FlowGraph* graph;
+    int32_t index;
+};
+
+static std::vector<FlowGraph*> graph_pool;
+static std::vector<FlowNodeRef> node_pool;
+static std::vector<int32_t> free_graph_ids;
+static std::vector<int32_t> free_node_ids;
+
+static void run_flow_node(void* data) {
+    auto node = static_cast<FlowNode*>(data);
+    auto graph = node->graph;
+    while (node) {
+        // Successors of skipped nodes still run, they are skipped in turn if the token is still cancelled
+        if (is_cancelled(graph->token))
+            skip_work(graph->token, 1);
+        else
+            node->closure.fn(node->closure.payload);
+
+        // Continue with the first successor that becomes ready and hand the others over to the pool
+        FlowNode* next = nullptr;
+        for (auto index : node->successors) {
+            auto succ = &graph->nodes[index];
+            if (succ->counter.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                continue;
+            if (!next) {
+                next = succ;
+            } else {
+                graph->pending.fetch_add(1, std::memory_order_relaxed);
+                ThreadPool::instance().submit(run_flow_node, succ);
+            }
+        }
+        node = next;
+    }
+    graph->pending.fetch_sub(1, std::memory_order_release);
+}
+
+static FlowGraph* find_graph(int32_t graph_id) {
+    if (graph_id < 0 || size_t(graph_id) >= graph_pool.size() || !graph_pool[graph_id])
+        return nullptr;
+    return graph_pool[graph_id];
+}
+
+static FlowNode* find_node(int32_t node_id) {
+    if (node_id < 0 || size_t(node_id) >= node_pool.size() || !node_pool[node_id].graph)
+        return nullptr;
+    return &node_pool[node_id].graph->nodes[node_pool[node_id].index];
+}
+
+int32_t anydsl_create_graph() {
     int32_t id;
-    if (free_ids.size()) {
-        id = free_ids.back();
-        free_ids.pop_back();
+    if (free_graph_ids.size()) {
+        id = free_graph_ids.back();
+        free_graph_ids.pop_back();
     } else {
-        id = static_cast<int32_t>(thread_pool.size());
+        id = int32_t(graph_pool.size());
+        graph_pool.emplace_back();
     }
 
-    auto spawned = std::make_pair(id, std::thread([=](){ fun_ptr(args); }));
-    thread_pool.emplace(std::move(spawned));
+    FlowGraph* graph = new FlowGraph();
+    graph->pending = 0;
+    graph_pool[id] = graph;
     return id;
 }
 
-void anydsl_sync_thread(int32_t id) {
-    auto thread = thread_pool.find(id);
-    if (thread != thread_pool.end()) {
-        thread->second.join();
-        free_ids.push_back(thread->first);
-        thread_pool.erase(thread);
+void anydsl_destroy_graph(int32_t graph_id) {
+    auto graph = find_graph(graph_id);
+    if (!graph)
+        assert(0 && "Trying to destroy invalid graph id");
+
+    for (auto node_id : graph->node_ids) {
+        node_pool[node_id] = FlowNodeRef { nullptr, -1 };
+        free_node_ids.push_back(node_id);
+    }
+    graph_pool[graph_id] = nullptr;
+    free_graph_ids.push_back(graph_id);
+    delete graph;
+}
+
+int32_t anydsl_create_task(int32_t graph_id, Closure closure) {
+    int32_t id;
+    if (free_node_ids.size()) {
+        id = free_node_ids.back();
+        free_node_ids.pop_back();
     } else {
-        assert(0 && "Trying to synchronize on invalid thread id");
+        id = int32_t(node_pool.size());
+        node_pool.emplace_back();
     }
+
+    auto graph = find_graph(graph_id);
+    if (!graph)
+        assert(0 && "Trying to find invalid graph id");
+
+    FlowNode node;
+    node.closure = closure;
+    node.graph = graph;
+    node.num_predecessors = 0;
+    node.counter = 0;
+    graph->nodes.emplace_back(std::move(node));
+    graph->node_ids.push_back(id);
+    node_pool[id] = FlowNodeRef { graph, int32_t(graph->nodes.size() - 1) };
+    return id;
+}
+
+void anydsl_create_edge(int32_t task1_id, int32_t task2_id) {
+    auto node1 = find_node(task1_id);
+    auto node2 = find_node(task2_id);
+    if (!node1 || !node2)
+        assert(0 && "Trying to find invalid task id");
+    assert(node1->graph == node2->graph && "Trying to connect tasks of different graphs");
+
+    node1->successors.push_back(node_pool[task2_id].index);
+    node2->num_predecessors++;
 }
 
-[[noreturn]] void tbb_required() {
-    error("Flow Graph implementation only available in TBB, rebuild runtime with TBB support!");
+void anydsl_execute_graph_cancellable(int32_t graph_id, int32_t root_id, int32_t token) {
+    auto graph = find_graph(graph_id);
+    if (graph) {
+        auto root = find_node(root_id);
+        if (!root)
+            assert(0 && "Trying to find invalid task id");
+
+        // A node runs once all of its predecessors have completed
+        for (auto& node : graph->nodes)
+            node.counter.store(node.num_predecessors, std::memory_order_relaxed);
+        graph->token = find_token(token);
+        graph->pending.store(1, std::memory_order_relaxed);
+        run_flow_node(root);
+        ThreadPool::instance().help_while(graph->pending);
+    } else {
+        assert(0 && "Trying to execute invalid graph id");
+    }
 }
-int32_t anydsl_create_graph() { tbb_required(); }
-int32_t anydsl_create_task(int32_t, Closure) { tbb_required(); }
-void anydsl_create_edge(int32_t, int32_t) { tbb_required(); }
-void anydsl_execute_graph(int32_t, int32_t) { tbb_required(); }
 #else // TBB version
-void anydsl_parallel_for(int32_t num_threads, int32_t lower, int32_t upper, void* args, void* fun) {
-    tbb::task_scheduler_init init((num_threads == 0) ? tbb::task_scheduler_init::automatic : num_threads);
-    void (*fun_ptr) (void*, int32_t, int32_t) = reinterpret_cast<void (*) (void*, int32_t, int32_t)>(fun);
+// Arenas are kept for the whole lifetime of the program, so that repeated loops reuse warm workers
+static std::mutex arena_mutex;
+static std::unordered_map<int32_t, std::unique_ptr<tbb::task_arena>> arena_pool;
+
+struct CallSite {
+    std::atomic_flag busy = ATOMIC_FLAG_INIT;
+    tbb::affinity_partitioner partitioner;
+};
+static std::unordered_map<void*, std::unique_ptr<CallSite>> call_sites;
+
+// Each thread caches the arenas and call sites it has used, so that repeated loops do not take the lock
+static thread_local std::unordered_map<int32_t, tbb::task_arena*> local_arenas;
+static thread_local std::unordered_map<void*, CallSite*> local_call_sites;
+
+static tbb::task_arena& find_arena(int32_t num_threads) {
+    auto& local = local_arenas[num_threads];
+    if (!local) {
+        std::lock_guard<std::mutex> lock(arena_mutex);
+        auto& arena = arena_pool[num_threads];
+        if (!arena)
+            arena.reset(new tbb::task_arena(num_threads == 0 ? tbb::task_arena::automatic : num_threads));
+        local = arena.get();
+    }
+    return *local;
+}
+
+static CallSite& find_call_site(void* fun) {
+    auto& local = local_call_sites[fun];
+    if (!local) {
+        std::lock_guard<std::mutex> lock(arena_mutex);
+        auto& site = call_sites[fun];
+        if (!site)
+            site.reset(new CallSite());
+        local = site.get();
+    }
+    return *local;
+}
 
-    tbb::parallel_for(tbb::blocked_range<int32_t>(lower, upper), [=] (const tbb::blocked_range<int32_t>& range) {
+void anydsl_parallel_for_schedule(int32_t num_threads, int32_t lower, int32_t upper,
+                                  int32_t schedule, int32_t grain, void* args, void* fun) {
+    void (*fun_ptr) (void*, int32_t, int32_t) = reinterpret_cast<void (*) (void*, int32_t, int32_t)>(fun);
+    auto body = [=] (const tbb::blocked_range<int32_t>& range) {
+        ScratchArena::Scope scope;
         fun_ptr(args, range.begin(), range.end());
-    });
+    };
+
+    auto loop = [&] {
+        switch (Schedule(schedule)) {
+            case Schedule::Static: {
+                if (grain <= 0) {
+                    // Replay the ranges of the previous run of this loop on the same threads
+                    auto& site = find_call_site(fun);
+                    if (!site.busy.test_and_set(std::memory_order_acquire)) {
+                        tbb::parallel_for(tbb::blocked_range<int32_t>(lower, upper), body, site.partitioner);
+                        site.busy.clear(std::memory_order_release);
+                        break;
+                    }
+                }
+                tbb::parallel_for(tbb::blocked_range<int32_t>(lower, upper, std::max(grain, 1)), body, tbb::static_partitioner());
+                break;
+            }
+            case Schedule::Dynamic:
+                tbb::parallel_for(tbb::blocked_range<int32_t>(lower, upper, std::max(grain, 1)), body, tbb::simple_partitioner());
+                break;
+            case Schedule::Guided:
+                tbb::parallel_for(tbb::blocked_range<int32_t>(lower, upper, std::max(grain, 1)), body, tbb::auto_partitioner());
+                break;
+        }
+    };
+
+    // A nested loop with the same number of threads runs directly in the arena of the enclosing loop
+    find_arena(num_threads).execute(loop);
 }
 
-static std::unordered_map<int32_t, tbb::task*> task_pool;
-static std::vector<int32_t> free_ids;
+// Number of runtime tasks executing on this thread
+static thread_local int32_t task_depth = 0;
 
 class RuntimeTask : public tbb::task {
 public:
-    RuntimeTask(void* args, void* fun)
-        : args_(args), fun_(fun)
+    RuntimeTask(void (*fun)(void*), void* data)
+        : fun_(fun), data_(data)
     {}
 
     tbb::task* execute() {
-        int32_t (*fun_ptr) (void*) = reinterpret_cast<int32_t (*) (void*)>(fun_);
-        fun_ptr(args_);
+        task_depth++;
+        fun_(data_);
+        task_depth--;
         return nullptr;
     }
 
 private:
-    void* args_;
-    void* fun_;
+    void (*fun_)(void*);
+    void* data_;
 };
 
-int32_t anydsl_spawn_thread(void* args, void* fun) {
-    int32_t id;
-    if (free_ids.size()) {
-        id = free_ids.back();
-        free_ids.pop_back();
-    } else {
-        id = int32_t(task_pool.size());
-    }
+static void submit_task(void (*fun)(void*), void* data) {
+    auto& task = *new (tbb::task::allocate_root()) RuntimeTask(fun, data);
+    // Tasks submitted from a task go to the deque of the thread, where waiting threads take or steal them
+    if (task_depth > 0)
+        tbb::task::spawn(task);
+    else
+        tbb::task::enqueue(task);
+}
 
-    tbb::task* root = new (tbb::task::allocate_root()) RuntimeTask(args, fun);
-    root->set_ref_count(2);
-    tbb::task* child = new (root->allocate_child()) RuntimeTask(args, fun);
-    root->spawn(*child);
-    task_pool[id] = root;
-    return id;
+// A waiting thread blocks in wait_for_all() on a root task of its own, running other tasks meanwhile.
+// The root holds one extra reference, dropped by notify_waiters() when a future is resolved.
+struct Waiter {
+    tbb::task* root;
+    bool woken;
+};
+
+static std::mutex waiter_mutex;
+static std::vector<Waiter*> waiters;
+static std::atomic<int32_t> num_waiters(0);
+
+static void notify_waiters() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_waiters.load(std::memory_order_relaxed) == 0)
+        return;
+    std::lock_guard<std::mutex> lock(waiter_mutex);
+    for (auto waiter : waiters) {
+        if (!waiter->woken) {
+            waiter->woken = true;
+            waiter->root->decrement_ref_count();
+        }
+    }
 }
 
-void anydsl_sync_thread(int32_t id) {
-    auto task = task_pool.find(id);
-    if (task != task_pool.end()) {
-        task->second->wait_for_all();
-        tbb::task::destroy(*task->second);
-        free_ids.push_back(task->first);
-        task_pool.erase(task);
-    } else {
-        assert(0 && "Trying to synchronize on invalid task id");
+static void wait_until(bool (*done)(void*), void* data) {
+    while (!done(data)) {
+        Waiter waiter = { new (tbb::task::allocate_root()) tbb::empty_task(), false };
+        waiter.root->set_ref_count(2);
+        {
+            std::lock_guard<std::mutex> lock(waiter_mutex);
+            waiters.push_back(&waiter);
+            num_waiters.fetch_add(1, std::memory_order_relaxed);
+        }
+        // Pairs with the fence in notify_waiters(): either the condition is seen here or the waiter is woken
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!done(data))
+            waiter.root->wait_for_all();
+        {
+            std::lock_guard<std::mutex> lock(waiter_mutex);
+            waiters.erase(std::find(waiters.begin(), waiters.end(), &waiter));
+            num_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+        waiter.root->set_ref_count(0);
+        tbb::task::destroy(*waiter.root);
     }
 }
 
-static std::unordered_map<int32_t, tbb::flow::graph*> graph_pool;
-static std::unordered_map<int32_t, tbb::flow::graph_node*> node_pool;
+typedef tbb::flow::continue_node<tbb::flow::continue_msg> FlowNode;
+
+struct FlowGraph {
+    tbb::flow::graph graph;
+    // Nodes are stored in blocks and never move, they are destroyed before the graph they belong to
+    std::deque<FlowNode> nodes;
+    // Ids of the nodes, released with the graph
+    std::vector<int32_t> node_ids;
+    // Token of the current execution, or nullptr
+    CancelToken* token = nullptr;
+};
+
+static std::vector<FlowGraph*> graph_pool;
+static std::vector<FlowNode*> node_pool;
 static std::vector<int32_t> free_graph_ids;
 static std::vector<int32_t> free_node_ids;
 
+static FlowGraph* find_graph(int32_t graph_id) {
+    if (graph_id < 0 || size_t(graph_id) >= graph_pool.size())
+        return nullptr;
+    return graph_pool[graph_id];
+}
+
+static FlowNode* find_node(int32_t node_id) {
+    if (node_id < 0 || size_t(node_id) >= node_pool.size())
+        return nullptr;
+    return node_pool[node_id];
+}
+
 int32_t anydsl_create_graph() {
     int32_t id;
     if (free_graph_ids.size()) {
@@ -339,13 +1119,28 @@ int32_t anydsl_create_graph() {
         free_graph_ids.pop_back();
     } else {
         id = int32_t(graph_pool.size());
+        graph_pool.emplace_back();
     }
 
-    tbb::flow::graph* graph = new tbb::flow::graph();
-    graph_pool[id] = graph;
+    graph_pool[id] = new FlowGraph();
     return id;
 }
 
+void anydsl_destroy_graph(int32_t graph_id) {
+    auto graph = find_graph(graph_id);
+    if (!graph)
+        assert(0 && "Trying to destroy invalid graph id");
+
+    graph->graph.wait_for_all();
+    for (auto node_id : graph->node_ids) {
+        node_pool[node_id] = nullptr;
+        free_node_ids.push_back(node_id);
+    }
+    graph_pool[graph_id] = nullptr;
+    free_graph_ids.push_back(graph_id);
+    delete graph;
+}
+
 int32_t anydsl_create_task(int32_t graph_id, Closure closure) {
     int32_t id;
     if (free_node_ids.size()) {
@@ -353,40 +1148,232 @@ int32_t anydsl_create_task(int32_t graph_id, Closure closure) {
         free_node_ids.pop_back();
     } else {
         id = int32_t(node_pool.size());
+        node_pool.emplace_back();
     }
 
-    auto graph = graph_pool.find(graph_id);
-    if (graph == graph_pool.end())
+    auto graph = find_graph(graph_id);
+    if (!graph)
         assert(0 && "Trying to find invalid graph id");
 
-    auto node = new tbb::flow::continue_node<tbb::flow::continue_msg>(*graph->second,
+    graph->nodes.emplace_back(graph->graph,
         [=](const tbb::flow::continue_msg &) {
+            if (is_cancelled(graph->token))
+                skip_work(graph->token, 1);
+            else
                 closure.fn(closure.payload);
         });
-    node_pool[id] = node;
+    graph->node_ids.push_back(id);
+    node_pool[id] = &graph->nodes.back();
     return id;
 }
 
 void anydsl_create_edge(int32_t task1_id, int32_t task2_id) {
-    auto node1 = node_pool.find(task1_id);
-    auto node2 = node_pool.find(task2_id);
-    if (node1 == node_pool.end() || node2 == node_pool.end())
+    auto node1 = find_node(task1_id);
+    auto node2 = find_node(task2_id);
+    if (!node1 || !node2)
         assert(0 && "Trying to find invalid task id");
 
-    tbb::flow::make_edge((tbb::flow::continue_node<tbb::flow::continue_msg>&)*node1->second,
-                         (tbb::flow::continue_node<tbb::flow::continue_msg>&)*node2->second);
+    tbb::flow::make_edge(*node1, *node2);
 }
 
-void anydsl_execute_graph(int32_t graph_id, int32_t root_id) {
-    auto graph = graph_pool.find(graph_id);
-    if (graph != graph_pool.end()) {
-        auto root = node_pool.find(root_id);
-        if (root == node_pool.end())
+void anydsl_execute_graph_cancellable(int32_t graph_id, int32_t root_id, int32_t token) {
+    auto graph = find_graph(graph_id);
+    if (graph) {
+        auto root = find_node(root_id);
+        if (!root)
             assert(0 && "Trying to find invalid task id");
-        ((tbb::flow::continue_node<tbb::flow::continue_msg>*)root->second)->try_put(tbb::flow::continue_msg());
-        graph->second->wait_for_all();
+        graph->token = find_token(token);
+        // Continue nodes reset their counters once they fire, so the graph can be executed again
+        root->try_put(tbb::flow::continue_msg());
+        graph->graph.wait_for_all();
     } else {
         assert(0 && "Trying to execute invalid graph id");
     }
 }
 #endif
+
+void anydsl_execute_graph(int32_t graph_id, int32_t root_id) {
+    anydsl_execute_graph_cancellable(graph_id, root_id, -1);
+}
+
+// Futures: spawned tasks and promises share the same ids, so that any of them can be awaited or continued
+struct Future {
+    int32_t id;
+    void* args;
+    void* fun;
+    // Future consumed by this one, its value is passed to fun
+    int32_t source;
+    // Token checked before running fun, inherited by continuations
+    CancelToken* token;
+    int64_t value;
+    std::mutex mutex;
+    // Protected by the mutex: future to run once this one is resolved, release on resolution
+    int32_t continuation;
+    bool detached;
+    std::atomic<int32_t> pending;
+};
+
+// Every pending task, promise and continuation holds a slot, so that the table must allow for many concurrent awaits
+static HandleTable<Future, 1 << 20> future_pool;
+
+static Future* new_future(void* args, void* fun, int32_t source, CancelToken* token) {
+    int32_t id = future_pool.alloc();
+    if (id < 0)
+        error("Too many pending futures: tasks, promises and continuations must be awaited or detached");
+
+    auto future = future_pool.get(id);
+    future->id = id;
+    future->args = args;
+    future->fun = fun;
+    future->source = source;
+    future->token = token;
+    future->value = 0;
+    future->continuation = -1;
+    future->detached = false;
+    future->pending.store(1, std::memory_order_relaxed);
+    return future;
+}
+
+static Future* find_future(int32_t id) {
+    auto future = future_pool.get(id);
+    if (!future)
+        error("Trying to use invalid future id %", id);
+    return future;
+}
+
+static bool is_resolved(const Future* future) {
+    return future->pending.load(std::memory_order_acquire) == 0;
+}
+
+static void run_future(void*);
+
+static void resolve(Future* future, int64_t value) {
+    future->value = value;
+    int32_t continuation;
+    bool detached;
+    {
+        std::lock_guard<std::mutex> lock(future->mutex);
+        continuation = future->continuation;
+        detached = future->detached;
+        future->pending.store(0, std::memory_order_release);
+    }
+    notify_waiters();
+    // The future may be released by a waiting thread from now on
+    if (continuation >= 0)
+        submit_task(run_future, future_pool.get(continuation));
+    else if (detached)
+        future_pool.release(future->id);
+}
+
+static void run_future(void* data) {
+    auto future = static_cast<Future*>(data);
+    int64_t value = 0;
+    int64_t source_value = 0;
+    if (future->source >= 0) {
+        source_value = future_pool.get(future->source)->value;
+        future_pool.release(future->source);
+    }
+    // Cancelled tasks resolve to 0
+    if (is_cancelled(future->token)) {
+        skip_work(future->token, 1);
+    } else if (future->source >= 0) {
+        value = reinterpret_cast<int64_t (*) (void*, int64_t)>(future->fun)(future->args, source_value);
+    } else {
+        value = reinterpret_cast<int32_t (*) (void*)>(future->fun)(future->args);
+    }
+    resolve(future, value);
+}
+
+int32_t anydsl_spawn_thread(void* args, void* fun) {
+    return anydsl_spawn_thread_cancellable(args, fun, -1);
+}
+
+int32_t anydsl_spawn_thread_cancellable(void* args, void* fun, int32_t token) {
+    auto future = new_future(args, fun, -1, find_token(token));
+    int32_t id = future->id;
+    submit_task(run_future, future);
+    return id;
+}
+
+void anydsl_sync_thread(int32_t id) {
+    anydsl_future_get(id);
+}
+
+int32_t anydsl_promise_create() {
+    return new_future(nullptr, nullptr, -1, nullptr)->id;
+}
+
+void anydsl_promise_set(int32_t id, int64_t value) {
+    auto future = find_future(id);
+    assert(!future->fun && "Trying to set the value of a spawned task");
+    if (is_resolved(future))
+        error("Trying to set the value of promise % twice", id);
+    resolve(future, value);
+}
+
+int32_t anydsl_future_then(int32_t id, void* args, void* fun) {
+    auto future = find_future(id);
+    auto next = new_future(args, fun, id, future->token);
+    int32_t next_id = next->id;
+    bool ready;
+    {
+        std::lock_guard<std::mutex> lock(future->mutex);
+        assert(future->continuation < 0 && !future->detached && "Future already consumed");
+        ready = is_resolved(future);
+        if (!ready)
+            future->continuation = next_id;
+    }
+    if (ready)
+        submit_task(run_future, next);
+    return next_id;
+}
+
+void anydsl_future_detach(int32_t id) {
+    auto future = find_future(id);
+    bool ready;
+    {
+        std::lock_guard<std::mutex> lock(future->mutex);
+        assert(future->continuation < 0 && !future->detached && "Future already consumed");
+        ready = is_resolved(future);
+        future->detached = !ready;
+    }
+    if (ready)
+        future_pool.release(id);
+}
+
+int64_t anydsl_future_get(int32_t id) {
+    auto future = find_future(id);
+    wait_until([] (void* data) { return is_resolved(static_cast<Future*>(data)); }, future);
+    int64_t value = future->value;
+    future_pool.release(id);
+    return value;
+}
+
+void anydsl_future_wait_all(const int32_t* ids, int32_t count) {
+    for (int32_t i = 0; i < count; i++)
+        wait_until([] (void* data) { return is_resolved(static_cast<Future*>(data)); }, find_future(ids[i]));
+}
+
+int32_t anydsl_future_wait_any(const int32_t* ids, int32_t count) {
+    struct WaitAny {
+        const int32_t* ids;
+        int32_t count;
+        int32_t index;
+    } wait = { ids, count, -1 };
+    if (count <= 0)
+        return -1;
+    for (int32_t i = 0; i < count; i++)
+        find_future(ids[i]);
+
+    wait_until([] (void* data) {
+        auto& wait = *static_cast<WaitAny*>(data);
+        for (int32_t i = 0; i < wait.count; i++) {
+            if (is_resolved(future_pool.get(wait.ids[i]))) {
+                wait.index = i;
+                return true;
+            }
+        }
+        return false;
+    }, &wait);
+    return wait.index;
+}
@@ -1,20 +1,32 @@
 #ifndef RUNTIME_H
 #define RUNTIME_H
 
+#include "device_cache.h"
+#include "memory_stats.h"
 #include "platform.h"
+#include "thread_pool.h"
 
 #include <cassert>
 #include <cstdlib>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 enum class ProfileLevel : uint8_t { None = 0, Full };
+/// Huge page policy for large host allocations: none, transparent huge pages, or pages from the hugetlb pool.
+enum class HugePages : uint8_t { Never = 0, Madvise, HugeTLB };
 
 class Runtime {
 public:
     Runtime();
 
     ~Runtime() {
+        if (profiling_enabled())
+            report_leaks();
+        // Caches release their memory through the platforms
+        device_caches_.clear();
         for (auto p: platforms_) {
             delete p;
         }
@@ -38,19 +50,34 @@ public:
     /// Allocates memory on the given device.
     void* alloc(PlatformId plat, DeviceId dev, int64_t size) {
         check_device(plat, dev);
-        return platforms_[plat]->alloc(dev, size);
+        auto cache = device_cache(plat, dev);
+        void* ptr = cache ? cache->alloc(size) : platforms_[plat]->alloc(dev, size);
+        record_alloc(plat, dev, ptr, size);
+        return ptr;
+    }
+
+    /// Allocates memory on the given device, with ANYDSL_ALLOC_* flags.
+    void* alloc_flags(PlatformId plat, DeviceId dev, int64_t size, int32_t flags) {
+        check_device(plat, dev);
+        void* ptr = platforms_[plat]->alloc_flags(dev, size, flags);
+        record_alloc(plat, dev, ptr, size);
+        return ptr;
     }
 
     /// Allocates page-locked memory on the given platform and device.
     void* alloc_host(PlatformId plat, DeviceId dev, int64_t size) {
         check_device(plat, dev);
-        return platforms_[plat]->alloc_host(dev, size);
+        void* ptr = platforms_[plat]->alloc_host(dev, size);
+        record_alloc(plat, dev, ptr, size);
+        return ptr;
     }
 
     /// Allocates unified memory on the given platform and device.
     void* alloc_unified(PlatformId plat, DeviceId dev, int64_t size) {
         check_device(plat, dev);
-        return platforms_[plat]->alloc_unified(dev, size);
+        void* ptr = platforms_[plat]->alloc_unified(dev, size);
+        record_alloc(plat, dev, ptr, size);
+        return ptr;
     }
 
     /// Returns the device memory associated with the page-locked memory.
@@ -62,15 +89,49 @@ public:
     /// Releases memory.
     void release(PlatformId plat, DeviceId dev, void* ptr) {
         check_device(plat, dev);
-        platforms_[plat]->release(dev, ptr);
+        record_release(plat, dev, ptr);
+        auto cache = device_cache(plat, dev);
+        if (!cache || !cache->release(ptr))
+            platforms_[plat]->release(dev, ptr);
     }
 
     /// Releases previously allocated page-locked memory.
     void release_host(PlatformId plat, DeviceId dev, void* ptr) {
         check_device(plat, dev);
+        record_release(plat, dev, ptr);
         platforms_[plat]->release_host(dev, ptr);
     }
 
+    /// Maps a file in host memory, to be released with release on the host.
+    void* map_file(const char* path, int32_t flags, int64_t& size) {
+        void* ptr = platforms_[0]->map_file(DeviceId(0), path, flags, size);
+        record_alloc(PlatformId(0), DeviceId(0), ptr, size);
+        return ptr;
+    }
+
+    /// Returns the memory cached by the allocator of the given device to the system.
+    void trim(PlatformId plat, DeviceId dev) {
+        check_device(plat, dev);
+        if (auto cache = device_cache(plat, dev))
+            cache->trim();
+        platforms_[plat]->trim(dev);
+    }
+
+    /// Returns the allocation statistics of the given device.
+    void memory_stats(PlatformId plat, DeviceId dev, MemoryStats* stats) {
+        check_device(plat, dev);
+        if ((size_t)dev < memory_trackers_[plat].size())
+            memory_trackers_[plat][dev]->counters().read(stats);
+        else
+            MemoryCounters().read(stats);
+    }
+
+    /// Returns the allocation statistics of all the devices of the given platform.
+    void platform_memory_stats(PlatformId plat, MemoryStats* stats) {
+        assert((size_t)plat < platforms_.size() && "Invalid platform");
+        platform_memory_[plat]->read(stats);
+    }
+
     /// Launches a kernel on the platform and device.
     void launch_kernel(PlatformId plat, DeviceId dev,
                        const char* file, const char* kernel,
@@ -116,16 +177,72 @@ public:
         }
     }
 
+    /// Fills memory with a pattern of 1 or 4 bytes.
+    void fill(PlatformId plat, DeviceId dev, void* ptr, int64_t offset, int64_t size, uint32_t pattern, int32_t pattern_size) {
+        check_device(plat, dev);
+        assert((pattern_size == 1 || (offset % 4 == 0 && size % 4 == 0)) && "Offset and size must be multiples of the pattern size");
+        if (size > 0)
+            platforms_[plat]->fill(dev, ptr, offset, size, pattern, pattern_size);
+    }
+
     bool profiling_enabled() { return profile_ == ProfileLevel::Full; }
 
+    /// Returns true if host allocations are first-touched with the partitioning of parallel_for.
+    bool first_touch_enabled() const { return first_touch_; }
+    /// Returns the huge page policy applied to large host allocations made without explicit flags.
+    HugePages huge_pages() const { return huge_pages_; }
+    /// Returns the size in bytes from which host copies are split across the threads of the pool.
+    int64_t parallel_copy_threshold() const { return parallel_copy_threshold_; }
+    /// Returns the size in bytes from which host copies use non-temporal stores.
+    int64_t streaming_copy_threshold() const { return streaming_copy_threshold_; }
+
 private:
+    /// Prints the memory still allocated on every device.
+    void report_leaks();
+
+    // Devices of unavailable platforms have no tracker, since they cannot allocate
+    void record_alloc(PlatformId plat, DeviceId dev, void* ptr, int64_t size) {
+        if ((size_t)dev < memory_trackers_[plat].size())
+            memory_trackers_[plat][dev]->record_alloc(ptr, size);
+    }
+
+    void record_release(PlatformId plat, DeviceId dev, void* ptr) {
+        if ((size_t)dev < memory_trackers_[plat].size())
+            memory_trackers_[plat][dev]->record_release(ptr);
+    }
+
+    /// Returns the caching sub-allocator of the device, or nullptr if caching is disabled for its platform.
+    DeviceCache* device_cache(PlatformId plat, DeviceId dev) {
+        if (!cached_platforms_[plat])
+            return nullptr;
+        std::lock_guard<std::mutex> lock(device_caches_mutex_);
+        auto& cache = device_caches_[std::make_pair(plat, dev)];
+        if (!cache) {
+            auto platform = platforms_[plat];
+            cache.reset(new DeviceCache(
+                [=] (int64_t size) { return platform->alloc(dev, size); },
+                [=] (void* ptr) { platform->release(dev, ptr); },
+                platform->addressable_memory()));
+        }
+        return cache.get();
+    }
+
     void check_device(PlatformId plat, DeviceId dev) {
         assert((size_t)dev < platforms_[plat]->dev_count() && "Invalid device");
         unused(plat, dev);
     }
 
     ProfileLevel profile_;
+    bool first_touch_;
+    HugePages huge_pages_;
+    int64_t parallel_copy_threshold_;
+    int64_t streaming_copy_threshold_;
     std::vector<Platform*> platforms_;
+    std::vector<bool> cached_platforms_;
+    std::vector<std::unique_ptr<MemoryCounters>> platform_memory_;
+    std::vector<std::vector<std::unique_ptr<MemoryTracker>>> memory_trackers_;
+    std::mutex device_caches_mutex_;
+    std::map<std::pair<PlatformId, DeviceId>, std::unique_ptr<DeviceCache>> device_caches_;
 };
 
 #endif
@@ -0,0 +1,53 @@
+#include <algorithm>
+
+#include "anydsl_runtime.h"
+#include "log.h"
+#include "scratch_arena.h"
+
+static const size_t alignment = 64;
+static const size_t min_block_size = 64 * 1024;
+
+ScratchArena::~ScratchArena() {
+    for (auto& block : blocks_)
+        anydsl_aligned_free(block.data);
+}
+
+ScratchArena& ScratchArena::local() {
+    static thread_local ScratchArena arena;
+    return arena;
+}
+
+void* ScratchArena::alloc(int64_t size) {
+    if (depth_ == 0)
+        error("Scratch memory can only be allocated in the body of a parallel loop");
+
+    size_t bytes = (std::max(size_t(size), size_t(1)) + alignment - 1) & ~(alignment - 1);
+    if (blocks_.empty() || offset_ + bytes > blocks_[block_].size) {
+        // Move to the next block, or insert a new one there: blocks before the current one may be in use
+        size_t next = blocks_.empty() ? 0 : block_ + 1;
+        if (next == blocks_.size() || blocks_[next].size < bytes) {
+            size_t block_size = std::max(bytes, blocks_.empty() ? min_block_size : 2 * blocks_[block_].size);
+            auto data = static_cast<char*>(anydsl_aligned_malloc(block_size, alignment));
+            if (!data)
+                error("Cannot allocate % bytes of scratch memory", block_size);
+            blocks_.insert(blocks_.begin() + next, Block { data, block_size });
+        }
+        block_ = next;
+        offset_ = 0;
+    }
+
+    void* ptr = blocks_[block_].data + offset_;
+    offset_ += bytes;
+    return ptr;
+}
+
+ScratchArena::Mark ScratchArena::enter() {
+    depth_++;
+    return Mark { block_, offset_ };
+}
+
+void ScratchArena::leave(Mark mark) {
+    depth_--;
+    block_ = mark.block;
+    offset_ = mark.offset;
+}
@@ -0,0 +1,52 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Bump-pointer allocator for the temporary buffers of parallel loop bodies, one per thread.
+/// Memory is reclaimed by rewinding to a previous mark, so that nested loops keep the buffers of the enclosing chunk.
+/// Blocks are kept once allocated: in steady state, allocating does not call the heap.
+class ScratchArena {
+public:
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    /// Marks the start of a chunk, everything allocated after the mark is reclaimed by the matching rewind.
+    class Scope {
+    public:
+        Scope() : arena_(local()), mark_(arena_.enter()) {}
+        ~Scope() { arena_.leave(mark_); }
+
+    private:
+        ScratchArena& arena_;
+        Mark mark_;
+    };
+
+    ~ScratchArena();
+
+    /// Returns the arena of the calling thread.
+    static ScratchArena& local();
+
+    /// Allocates size bytes aligned to a cache line. Only valid within a scope.
+    void* alloc(int64_t size);
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    Mark enter();
+    void leave(Mark mark);
+
+    std::vector<Block> blocks_;
+    size_t block_ = 0;
+    size_t offset_ = 0;
+    int depth_ = 0;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "stream_loader.h"
+#include "log.h"
+
+#include <algorithm>
+#include <thread>
+
+StreamLoader::StreamLoader(int32_t dev, int64_t chunk_size, int32_t depth)
+    : dev_(dev), chunk_size_(chunk_size), slots_(depth)
+{
+    int32_t plat = dev & 0x0F;
+    on_host_ = plat == ANYDSL_HOST;
+    // Copies from page-locked memory are faster, but only some platforms can allocate it
+    page_locked_ = plat == ANYDSL_CUDA || plat == ANYDSL_HSA;
+    for (auto& slot : slots_) {
+        if (!on_host_)
+            slot.device = anydsl_alloc(dev_, chunk_size_);
+    }
+}
+
+StreamLoader::~StreamLoader() {
+    for (auto& slot : slots_) {
+        if (slot.device)
+            anydsl_release(dev_, slot.device);
+        if (slot.staging && page_locked_)
+            anydsl_release_host(dev_, slot.staging);
+        else if (slot.staging)
+            anydsl_release(0, slot.staging);
+    }
+}
+
+void StreamLoader::run_file(const char* path, void* args, ChunkFn fun, StreamStats* stats) {
+    std::FILE* file = std::fopen(path, "rb");
+    if (!file)
+        error("Cannot open file '%'", path);
+    std::fseek(file, 0, SEEK_END);
+    int64_t size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+
+    for (auto& slot : slots_) {
+        if (!slot.staging)
+            slot.staging = (char*)(page_locked_ ? anydsl_alloc_host(dev_, chunk_size_) : anydsl_alloc(0, chunk_size_));
+    }
+    run(file, nullptr, size, args, fun, stats);
+    std::fclose(file);
+}
+
+void StreamLoader::run_host(const void* src, int64_t size, void* args, ChunkFn fun, StreamStats* stats) {
+    run(nullptr, (const char*)src, size, args, fun, stats);
+}
+
+void StreamLoader::run(std::FILE* file, const char* src, int64_t size, void* args, ChunkFn fun, StreamStats* stats) {
+    file_ = file;
+    src_ = src;
+    size_ = size;
+    args_ = args;
+    fun_ = fun;
+    for (auto& time : stage_time_)
+        time = 0;
+    copy_time_ = 0;
+    for (auto& slot : slots_)
+        slot.stage = 0;
+
+    // Data in host memory needs no staging
+    std::vector<Stage> stages;
+    if (file)
+        stages.push_back(Stage::Read);
+    stages.push_back(Stage::Process);
+
+    uint64_t start = anydsl_get_micro_time();
+    int64_t num_chunks = (size + chunk_size_ - 1) / chunk_size_;
+    std::vector<std::thread> threads;
+    for (int i = 0; i + 1 < int(stages.size()); i++)
+        threads.emplace_back([&, i] { run_stage(stages, i, num_chunks); });
+    run_stage(stages, int(stages.size()) - 1, num_chunks);
+    for (auto& thread : threads)
+        thread.join();
+
+    if (stats) {
+        stats->bytes        = size;
+        stats->read_time    = stage_time_[int(Stage::Read)];
+        stats->copy_time    = copy_time_;
+        stats->process_time = stage_time_[int(Stage::Process)];
+        stats->total_time   = anydsl_get_micro_time() - start;
+    }
+}
+
+void StreamLoader::run_stage(const std::vector<Stage>& stages, int index, int64_t num_chunks) {
+    Stage stage = stages[index];
+    int next = (index + 1) % int(stages.size());
+    int64_t busy = 0;
+    for (int64_t chunk = 0; chunk < num_chunks; chunk++) {
+        auto& slot = slots_[chunk % slots_.size()];
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [&] { return slot.stage == index; });
+        }
+
+        uint64_t begin = anydsl_get_micro_time();
+        int64_t offset = chunk * chunk_size_;
+        switch (stage) {
+            case Stage::Read:
+                slot.size = std::min(chunk_size_, size_ - offset);
+                if (std::fread(slot.staging, slot.size, 1, file_) != 1)
+                    error("Cannot read % bytes from the input of the stream", slot.size);
+                slot.host = slot.staging;
+                break;
+            case Stage::Process:
+                if (!file_) {
+                    slot.size = std::min(chunk_size_, size_ - offset);
+                    slot.host = src_ + offset;
+                }
+                if (!on_host_) {
+                    uint64_t copy_begin = anydsl_get_micro_time();
+                    anydsl_copy(0, slot.host, 0, dev_, slot.device, 0, slot.size);
+                    copy_time_ += anydsl_get_micro_time() - copy_begin;
+                }
+                fun_(args_, on_host_ ? (void*)slot.host : slot.device, offset, slot.size);
+                // The slot is reused as soon as this stage completes: kernels working on it must be done
+                if (!on_host_)
+                    anydsl_synchronize(dev_);
+                break;
+        }
+        busy += anydsl_get_micro_time() - begin;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slot.stage = next;
+        }
+        cond_.notify_all();
+    }
+    stage_time_[int(stage)] = busy;
+}
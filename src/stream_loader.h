@@ -0,0 +1,61 @@
+#ifndef STREAM_LOADER_H
+#define STREAM_LOADER_H
+
+#include "anydsl_runtime.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+/// Streams data from a file or from host memory to a device, chunk by chunk. Reading and processing run on
+/// separate threads, connected by a ring of staging buffers, so that reading overlaps with the other stages.
+/// Copies to the device are issued by the processing thread: they go through the same in-order queue of the
+/// device as the kernels, so that a separate copy thread would only wait on them.
+class StreamLoader {
+public:
+    /// Called with the chunk in device memory, its offset in the source and its size, in bytes.
+    typedef void (*ChunkFn) (void*, void*, int64_t, int64_t);
+
+    StreamLoader(int32_t dev, int64_t chunk_size, int32_t depth);
+    ~StreamLoader();
+
+    void run_file(const char* path, void* args, ChunkFn fun, StreamStats* stats);
+    void run_host(const void* src, int64_t size, void* args, ChunkFn fun, StreamStats* stats);
+
+private:
+    struct Slot {
+        char* staging = nullptr;
+        void* device = nullptr;
+        const char* host = nullptr;
+        int64_t size = 0;
+        // Index of the next stage to process the slot
+        int stage = 0;
+    };
+
+    enum class Stage { Read, Process };
+
+    void run(std::FILE* file, const char* src, int64_t size, void* args, ChunkFn fun, StreamStats* stats);
+    void run_stage(const std::vector<Stage>& stages, int index, int64_t num_chunks);
+
+    int32_t dev_;
+    int64_t chunk_size_;
+    bool on_host_;
+    bool page_locked_;
+    std::vector<Slot> slots_;
+
+    // State of the current run
+    std::FILE* file_;
+    const char* src_;
+    int64_t size_;
+    void* args_;
+    ChunkFn fun_;
+    int64_t stage_time_[2];
+    int64_t copy_time_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+#endif
@@ -0,0 +1,403 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "log.h"
+#include "scratch_arena.h"
+
+// Number of polls of the job counter before an idle thread parks or yields
+static const int spin_count = 1 << 12;
+
+// Set in entered_ once the caller is done: workers arriving late do not take part any more
+static const uint64_t job_closed = 1u << 31;
+
+static thread_local bool in_parallel = false;
+// Index of the worker running on this thread, 0 for threads outside of the pool
+static thread_local int32_t worker_id = 0;
+
+static inline void cpu_relax() {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+ThreadPool& ThreadPool::instance() {
+    // Keep at least one worker, so that submitted tasks run without waiting for a thread to help
+    static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+    return pool;
+}
+
+ThreadPool::ThreadPool(size_t num_workers)
+    : job_(nullptr), gen_(0), entered_(0), stop_(false)
+    , num_workers_(num_workers), workers_(new Worker[num_workers]), num_parked_(0)
+    , queues_(new TaskQueue[num_workers + 1]), num_queued_(0), claimed_(new Counter[num_workers + 1])
+{
+    for (size_t i = 0; i < num_workers_; i++) {
+        workers_[i].parked = false;
+        workers_[i].thread = std::thread([this, i] () { worker_loop(int32_t(i + 1)); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    stop_ = true;
+    for (size_t i = 0; i < num_workers_; i++) {
+        { std::lock_guard<std::mutex> lock(workers_[i].mutex); }
+        workers_[i].cond.notify_one();
+        workers_[i].thread.join();
+    }
+}
+
+#ifdef __linux__
+// Returns the CPUs this process may run on, grouped by NUMA node
+static std::vector<std::vector<int>> numa_nodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return {};
+
+    std::vector<std::vector<int>> nodes;
+    for (int node = 0; ; node++) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file) break;
+
+        // Ranges of CPUs, as in "0-7,16-23"
+        std::vector<int> cpus;
+        std::string range;
+        while (std::getline(file, range, ',')) {
+            auto dash = range.find('-');
+            int first = std::stoi(range);
+            int last = dash != std::string::npos ? std::stoi(range.substr(dash + 1)) : first;
+            for (int cpu = first; cpu <= last; cpu++) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            }
+        }
+        if (!cpus.empty())
+            nodes.push_back(std::move(cpus));
+    }
+
+    // No NUMA information available: treat the machine as a single node
+    if (nodes.empty()) {
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed))
+                nodes.back().push_back(cpu);
+        }
+    }
+    return nodes;
+}
+
+void ThreadPool::set_affinity(Affinity affinity) {
+    if (affinity == Affinity::None) return;
+
+    auto nodes = numa_nodes();
+    if (nodes.empty()) return;
+    std::vector<int> cpus;
+    for (auto& node : nodes)
+        cpus.insert(cpus.end(), node.begin(), node.end());
+
+    for (size_t i = 0; i < num_workers_; i++) {
+        // The calling thread of a loop takes the first place
+        const size_t id = i + 1;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        switch (affinity) {
+            case Affinity::Compact:
+                CPU_SET(cpus[id % cpus.size()], &set);
+                break;
+            case Affinity::Scatter: {
+                auto& node = nodes[id % nodes.size()];
+                CPU_SET(node[(id / nodes.size()) % node.size()], &set);
+                break;
+            }
+            case Affinity::Node:
+                for (auto cpu : nodes[id * nodes.size() / num_threads()])
+                    CPU_SET(cpu, &set);
+                break;
+            default:
+                break;
+        }
+        if (pthread_setaffinity_np(workers_[i].thread.native_handle(), sizeof(set), &set) != 0)
+            debug("Cannot set the affinity of worker %", id);
+    }
+}
+#else
+void ThreadPool::set_affinity(Affinity affinity) {
+    if (affinity != Affinity::None)
+        debug("Thread affinity is only supported on Linux");
+}
+#endif
+
+void ThreadPool::parallel_for(int32_t num_threads, int32_t lower, int32_t upper,
+                              Schedule schedule, int32_t grain, void* args, RangeFn fun) {
+    Job job;
+    job.fun        = fun;
+    job.args       = args;
+    job.lower      = lower;
+    job.upper      = upper;
+    job.num_slices = std::max(num_threads, 1);
+    job.schedule   = schedule;
+    job.grain      = grain;
+    job.next       = lower;
+    job.claimed    = nullptr;
+
+    const int32_t num_active = int32_t(std::min(size_t(job.num_slices), this->num_threads()));
+    if (job.schedule == Schedule::Dynamic && job.grain <= 0)
+        job.grain = int32_t(std::max((int64_t(upper) - lower) / (int64_t(num_active) * 16), int64_t(1)));
+    if (num_active == 1) {
+        Counter claimed;
+        claimed.value = 0;
+        job.claimed = &claimed;
+        run(job, 0, 1);
+        return;
+    }
+    // Another thread owns the workers: run as a nested loop, whose shares are stolen by idle threads
+    std::unique_lock<std::mutex> guard(submit_mutex_, std::defer_lock);
+    if (in_parallel || !guard.try_lock()) {
+        run_nested(job, num_active);
+        return;
+    }
+
+    job_ = &job;
+    job.claimed = claimed_.get();
+    for (int32_t i = 0; i < num_active; i++)
+        claimed_[i].value.store(0, std::memory_order_relaxed);
+
+    // Publish the job by moving to the next generation, then wake up the workers taking part
+    const uint64_t gen = ((gen_.load(std::memory_order_relaxed) >> 32) + 1) << 32;
+    entered_.store(gen, std::memory_order_relaxed);
+    gen_.store(gen | uint32_t(num_active));
+    for (int32_t i = 0; i < num_active - 1; i++) {
+        auto& worker = workers_[i];
+        // Pairs with the sequentially consistent store to parked in worker_loop
+        if (worker.parked.load()) {
+            { std::lock_guard<std::mutex> lock(worker.mutex); }
+            worker.cond.notify_one();
+        }
+    }
+
+    in_parallel = true;
+    run(job, 0, num_active);
+
+    // Every chunk has been claimed: wait for the workers still running theirs and keep the others out
+    for (int i = 0; ; i++) {
+        uint64_t entered = entered_.load(std::memory_order_acquire);
+        if ((entered & ~job_closed & 0xFFFFFFFF) == 0 &&
+            entered_.compare_exchange_weak(entered, entered | job_closed, std::memory_order_acq_rel))
+            break;
+        // Help with the tasks of nested loops started by the workers
+        if (run_task()) continue;
+        if (i < spin_count) cpu_relax();
+        else std::this_thread::yield();
+    }
+    in_parallel = false;
+}
+
+void ThreadPool::run_nested(Job& job, int32_t num_active) {
+    // The shares of the other threads are queued as tasks, so that idle threads of the pool can steal them.
+    // No thread is ever created: however deep the nesting, at most num_threads() threads run loop bodies.
+    struct Share {
+        Job* job;
+        int32_t id;
+        int32_t num_threads;
+        std::atomic<int32_t>* pending;
+    };
+
+    std::unique_ptr<Counter[]> claimed(new Counter[num_active]);
+    std::unique_ptr<Share[]> shares(new Share[num_active]);
+    std::atomic<int32_t> pending(num_active - 1);
+    job.claimed = claimed.get();
+    for (int32_t i = 0; i < num_active; i++) {
+        claimed[i].value.store(0, std::memory_order_relaxed);
+        shares[i] = Share { &job, i, num_active, &pending };
+    }
+
+    for (int32_t i = 1; i < num_active; i++) {
+        submit([] (void* data) {
+            auto share = static_cast<Share*>(data);
+            run(*share->job, share->id, share->num_threads);
+            share->pending->fetch_sub(1, std::memory_order_release);
+        }, &shares[i]);
+    }
+
+    // Shares nobody has stolen are still in our own queue: help_while runs them here at the latest
+    run(job, 0, num_active);
+    help_while(pending);
+}
+
+bool ThreadPool::enter(uint64_t gen) {
+    uint64_t entered = entered_.load(std::memory_order_acquire);
+    do {
+        if ((entered >> 32) != (gen >> 32) || (entered & job_closed))
+            return false;
+    } while (!entered_.compare_exchange_weak(entered, entered + 1, std::memory_order_acq_rel));
+    return true;
+}
+
+void ThreadPool::run_chunk(Job& job, int32_t lower, int32_t upper) {
+    // Scratch memory allocated by the body is reclaimed at the end of the chunk
+    ScratchArena::Scope scope;
+    job.fun(job.args, lower, upper);
+}
+
+void ThreadPool::run(Job& job, int32_t id, int32_t num_threads) {
+    const int64_t lower = job.lower;
+    const int64_t upper = job.upper;
+    const int64_t grain = job.grain;
+    switch (job.schedule) {
+        case Schedule::Static: {
+            const int64_t linear = (upper - lower) / job.num_slices;
+            const int64_t num_chunks = grain <= 0 ? job.num_slices : (upper - lower + grain - 1) / grain;
+            // Thread t owns chunks t, t + num_threads, ...: run our own first, then those not started by others
+            for (int32_t j = 0; j < num_threads; j++) {
+                const int32_t t = (id + j) % num_threads;
+                for (int64_t i; (i = t + job.claimed[t].value.fetch_add(1, std::memory_order_relaxed) * num_threads) < num_chunks; ) {
+                    if (grain <= 0) {
+                        const int64_t a = lower + i * linear;
+                        run_chunk(job, int32_t(a), int32_t(i == job.num_slices - 1 ? upper : a + linear));
+                    } else {
+                        const int64_t a = lower + i * grain;
+                        run_chunk(job, int32_t(a), int32_t(std::min(a + grain, upper)));
+                    }
+                }
+            }
+            break;
+        }
+        case Schedule::Dynamic:
+            for (int64_t a; (a = job.next.fetch_add(grain, std::memory_order_relaxed)) < upper; )
+                run_chunk(job, int32_t(a), int32_t(std::min(a + grain, upper)));
+            break;
+        case Schedule::Guided: {
+            int64_t a = job.next.load(std::memory_order_relaxed);
+            while (a < upper) {
+                const int64_t chunk = std::max((upper - a) / (2 * num_threads), std::max(grain, int64_t(1)));
+                const int64_t b = std::min(a + chunk, upper);
+                if (job.next.compare_exchange_weak(a, b, std::memory_order_relaxed)) {
+                    run_chunk(job, int32_t(a), int32_t(b));
+                    a = job.next.load(std::memory_order_relaxed);
+                }
+            }
+            break;
+        }
+    }
+}
+
+void ThreadPool::submit(TaskFn fun, void* data) {
+    {
+        auto& queue = queues_[worker_id];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.push_back(Task { fun, data });
+    }
+
+    // Pairs with the sequentially consistent increment of num_parked_ in worker_loop
+    num_queued_.fetch_add(1);
+    if (num_parked_.load() == 0) return;
+    for (size_t i = 0; i < num_workers_; i++) {
+        auto& worker = workers_[i];
+        if (worker.parked.load()) {
+            { std::lock_guard<std::mutex> lock(worker.mutex); }
+            worker.cond.notify_one();
+            break;
+        }
+    }
+}
+
+void ThreadPool::help_while(const std::atomic<int32_t>& pending) {
+    help_until([] (void* data) {
+        return static_cast<const std::atomic<int32_t>*>(data)->load(std::memory_order_acquire) == 0;
+    }, const_cast<std::atomic<int32_t>*>(&pending));
+}
+
+void ThreadPool::help_until(bool (*done)(void*), void* data) {
+    for (int i = 0; !done(data); ) {
+        if (run_task()) {
+            i = 0;
+            continue;
+        }
+        // Back off progressively, the awaited task may run for a long time on another thread
+        if (i < spin_count) cpu_relax();
+        else if (i < 2 * spin_count) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+        i++;
+    }
+}
+
+void ThreadPool::TaskQueue::push_back(const Task& task) {
+    if (tail - head == tasks.size()) {
+        std::vector<Task> grown(std::max(tasks.size() * 2, size_t(64)));
+        for (size_t i = head; i != tail; i++)
+            grown[i - head] = tasks[i & (tasks.size() - 1)];
+        tasks.swap(grown);
+        tail -= head;
+        head = 0;
+    }
+    tasks[tail++ & (tasks.size() - 1)] = task;
+}
+
+bool ThreadPool::run_task() {
+    if (num_queued_.load(std::memory_order_relaxed) == 0)
+        return false;
+
+    // Take the most recent task from our own queue, or steal the oldest one from another queue
+    Task task = { nullptr, nullptr };
+    for (size_t i = 0; i <= num_workers_ && !task.fun; i++) {
+        auto& queue = queues_[(worker_id + i) % (num_workers_ + 1)];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.empty()) continue;
+        task = i == 0 ? queue.pop_back() : queue.pop_front();
+    }
+    if (!task.fun) return false;
+
+    num_queued_.fetch_sub(1, std::memory_order_relaxed);
+    // Tasks may be shares of nested loops: loops they start must nest as well, even on threads outside of the pool
+    bool was_parallel = in_parallel;
+    in_parallel = true;
+    task.fun(task.data);
+    in_parallel = was_parallel;
+    return true;
+}
+
+void ThreadPool::worker_loop(int32_t id) {
+    auto& worker = workers_[id - 1];
+    in_parallel = true;
+    worker_id = id;
+    uint64_t seen = 0;
+    while (true) {
+        if (run_task()) continue;
+
+        auto idle = [&] (uint64_t gen) { return (gen >> 32) == (seen >> 32) && num_queued_.load() == 0; };
+        uint64_t gen = gen_.load(std::memory_order_acquire);
+        for (int i = 0; i < spin_count && idle(gen); i++) {
+            cpu_relax();
+            gen = gen_.load(std::memory_order_acquire);
+        }
+        if (idle(gen) && !stop_) {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.parked = true;
+            num_parked_.fetch_add(1);
+            worker.cond.wait(lock, [&] { return stop_ || !idle(gen_.load()); });
+            num_parked_.fetch_sub(1);
+            worker.parked = false;
+            gen = gen_.load(std::memory_order_acquire);
+        }
+        if (stop_) break;
+        if ((gen >> 32) == (seen >> 32)) continue;
+
+        // The caller waits for the workers that entered the job, so it stays valid until they leave
+        seen = gen;
+        const int32_t num_active = int32_t(gen & 0xFFFFFFFF);
+        if (id < num_active && enter(gen)) {
+            run(*job_, id, num_active);
+            entered_.fetch_sub(1, std::memory_order_release);
+        }
+    }
+}
@@ -0,0 +1,129 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Loop scheduling policy, values match the ANYDSL_SCHEDULE_* constants.
+enum class Schedule : int32_t { Static = 0, Dynamic, Guided };
+
+/// Placement of the workers on the cores of the machine:
+/// - Compact: consecutive workers on consecutive cores, filling one NUMA node after the other,
+/// - Scatter: consecutive workers on different NUMA nodes,
+/// - Node: workers distributed compactly over the NUMA nodes, free to move within their node.
+enum class Affinity : int32_t { None = 0, Compact, Scatter, Node };
+
+/// Process-wide pool of worker threads, created lazily on first use and reused across calls.
+/// Idle workers spin for a short while before parking on a condition variable.
+class ThreadPool {
+public:
+    typedef void (*RangeFn)(void*, int32_t, int32_t);
+    typedef void (*TaskFn)(void*);
+
+    ~ThreadPool();
+
+    /// Returns the process-wide pool, creating it on first use.
+    static ThreadPool& instance();
+
+    /// Returns the number of threads running a parallel loop, including the calling thread.
+    size_t num_threads() const { return num_workers_ + 1; }
+
+    /// Pins the workers according to the given policy. The calling thread of a loop is never pinned.
+    void set_affinity(Affinity affinity);
+
+    /// Runs fun(args, a, b) on chunks of [lower, upper) using at most num_threads threads.
+    /// The calling thread takes part in the loop and returns once every chunk has completed.
+    /// Loops nested in a loop body or in a task, and loops started while another thread owns the workers,
+    /// are split into tasks that idle threads steal.
+    /// - Static: without grain, num_threads equal slices, the last slice getting the remainder;
+    ///   with grain, chunks of that size dealt round-robin to the threads. Chunks a thread has
+    ///   not started yet are taken over by the threads that are done with their own.
+    /// - Dynamic: chunks of grain iterations handed out on demand (default: 1/16th of a thread's share).
+    /// - Guided: chunks shrinking with the remaining work, never smaller than grain (default: 1).
+    void parallel_for(int32_t num_threads, int32_t lower, int32_t upper,
+                      Schedule schedule, int32_t grain, void* args, RangeFn fun);
+
+    /// Queues fun(data) for execution by any thread of the pool.
+    /// Tasks submitted from a worker go to its own queue and are stolen by idle threads.
+    void submit(TaskFn fun, void* data);
+    /// Runs queued tasks on the calling thread until pending drops to zero.
+    void help_while(const std::atomic<int32_t>& pending);
+    /// Runs queued tasks on the calling thread until done(data) returns true.
+    void help_until(bool (*done)(void*), void* data);
+
+private:
+    struct Counter {
+        std::atomic<int64_t> value;
+        char padding[64 - sizeof(std::atomic<int64_t>)];
+    };
+
+    struct Job {
+        RangeFn fun;
+        void* args;
+        int32_t lower;
+        int32_t upper;
+        int32_t num_slices;
+        Schedule schedule;
+        int32_t grain;
+        std::atomic<int64_t> next;
+        Counter* claimed;
+    };
+
+    struct Task {
+        TaskFn fun;
+        void* data;
+    };
+
+    /// Ring buffer of tasks, only grows so that steady-state use does not allocate.
+    struct TaskQueue {
+        std::mutex mutex;
+        std::vector<Task> tasks;
+        size_t head = 0;
+        size_t tail = 0;
+
+        bool empty() const { return head == tail; }
+        void push_back(const Task& task);
+        Task pop_back() { return tasks[--tail & (tasks.size() - 1)]; }
+        Task pop_front() { return tasks[head++ & (tasks.size() - 1)]; }
+    };
+
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::atomic<bool> parked;
+    };
+
+    ThreadPool(size_t num_workers);
+
+    void worker_loop(int32_t id);
+    void run_nested(Job& job, int32_t num_active);
+    bool enter(uint64_t gen);
+    bool run_task();
+    static void run_chunk(Job& job, int32_t lower, int32_t upper);
+    static void run(Job& job, int32_t id, int32_t num_threads);
+
+    Job* job_;
+    // Generation in the upper 32 bits, number of threads taking part in the lower 32 bits
+    std::atomic<uint64_t> gen_;
+    // Generation in the upper 32 bits, closed flag and number of workers running the job in the lower 32 bits
+    std::atomic<uint64_t> entered_;
+    std::atomic<bool> stop_;
+    std::mutex submit_mutex_;
+
+    size_t num_workers_;
+    std::unique_ptr<Worker[]> workers_;
+    std::atomic<int32_t> num_parked_;
+    // Task queue of each worker, the first one being shared by the threads outside of the pool
+    std::unique_ptr<TaskQueue[]> queues_;
+    std::atomic<int32_t> num_queued_;
+    // Number of static chunks claimed from each thread taking part in the current job
+    std::unique_ptr<Counter[]> claimed_;
+};
+
+#endif